@@ -1,21 +0,0 @@
-python MakeHistogram.py images/florida.png out/florida.histogram.png 12000
-python MakeHistogram.py images/bigcat.png out/bigcat.histogram.png 12000
-python MakeHistogram.py images/dunes.png out/dunes.histogram.png 12000
-python MakeHistogram.py images/turtle.png out/turtle.histogram.png 12000
-
-python MakeHistogram.py out/florida-dunes.png out/florida-dunes.histogram.png 12000
-python MakeHistogram.py out/florida-turtle.png out/florida-turtle.histogram.png 12000
-python MakeHistogram.py out/florida-bigcat.png out/florida-bigcat.histogram.png 12000
-
-python MakeHistogram.py out/florida-bigcat_25.png out/florida-bigcat_25.histogram.png 12000
-python MakeHistogram.py out/florida-bigcat_50.png out/florida-bigcat_50.histogram.png 12000
-python MakeHistogram.py out/florida-bigcat_75.png out/florida-bigcat_75.histogram.png 12000
-
-python MakeHistogram.py out/florida-turtle_0_dunes_33.png out/florida-turtle_0_dunes_33.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_0_dunes_66.png out/florida-turtle_0_dunes_66.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_33_dunes_0.png out/florida-turtle_33_dunes_0.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_66_dunes_0.png out/florida-turtle_66_dunes_0.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_33_dunes_33.png out/florida-turtle_33_dunes_33.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_33_dunes_66.png out/florida-turtle_33_dunes_66.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_66_dunes_33.png out/florida-turtle_66_dunes_33.histogram.png 12000
-python MakeHistogram.py out/florida-turtle_66_dunes_0.png out/florida-turtle_66_dunes_0.histogram.png 12000
\ No newline at end of file
@@ -0,0 +1,297 @@
+#pragma once
+
+// A compact file format for optimal transport results.
+// It stores the displacement (result - source) instead of the result, since that is small and smooth.
+// The displacement is quantized to int16 or int8, with a scale per channel, so the largest displacement uses the full range.
+// The image is split into strips of rows, which are compressed independently, so they can be read one at a time.
+// In a strip, each channel is a plane of values, delta coded along the rows. int16 planes are split into a
+// plane of low bytes and a plane of high bytes, so DEFLATE sees the mostly constant high bytes together.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+// Strips are decompressed with stbi_zlib_decode_noheader_buffer, so stb_image.h needs to be included before this
+#include "pngwriter.h"
+
+struct DisplacementFieldOptions
+{
+	int bits = 16;                       // 16 or 8
+	float minStep = 1.0f / 16.0f;        // the smallest quantization step, in 0 to 255 color units. Finer steps only store noise.
+	int compressionLevel = 6;            // 0 is uncompressed, 1 is fastest, 9 is smallest
+	int rowsPerStrip = 64;               // how many rows are compressed together, and read at a time
+};
+
+namespace DisplacementField
+{
+	static const char c_magic[8] = { 'S', 'O', 'T', 'D', 'I', 'S', 'P', 0 };
+	static const uint32_t c_version = 1;
+	static const size_t c_inflatePadding = 8;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t channels;
+		uint32_t bits;
+		uint32_t compressed;
+		uint32_t rowsPerStrip;
+		uint32_t numStrips;
+		float scale[3];
+	};
+
+	// Where a strip is in the file. They follow the header and strip table in order.
+	struct Strip
+	{
+		uint64_t offset;
+		uint32_t storedSize;
+		uint32_t rawSize;
+	};
+
+	inline int StripRows(int height, int rowsPerStrip, int stripIndex)
+	{
+		return std::min(rowsPerStrip, height - stripIndex * rowsPerStrip);
+	}
+
+	// The size of a strip after quantization and before compression
+	inline size_t RawStripSize(int width, int stripRows, int bits)
+	{
+		return size_t(width) * size_t(stripRows) * 3 * (bits / 8);
+	}
+
+	// Quantizes, delta codes and byte splits the rows of a strip
+	inline void EncodeStrip(unsigned char* dest, const float* src, const float* result, int width, int stripRows, int bits, const float scale[3])
+	{
+		const size_t planeSize = size_t(width) * size_t(stripRows);
+		const int maxValue = (bits == 16) ? 32767 : 127;
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const float invScale = 1.0f / scale[channel];
+			unsigned char* plane = &dest[planeSize * channel * (bits / 8)];
+			for (int y = 0; y < stripRows; ++y)
+			{
+				int previous = 0;
+				for (int x = 0; x < width; ++x)
+				{
+					const size_t pixelIndex = size_t(y) * width + x;
+					const size_t valueIndex = pixelIndex * 3 + channel;
+					int value = (int)lrintf((result[valueIndex] - src[valueIndex]) * invScale);
+					value = std::max(std::min(value, maxValue), -maxValue);
+
+					// The deltas wrap around, which the decoder undoes
+					const int delta = value - previous;
+					previous = value;
+					plane[pixelIndex] = (unsigned char)delta;
+					if (bits == 16)
+						plane[planeSize + pixelIndex] = (unsigned char)(delta >> 8);
+				}
+			}
+		}
+	}
+
+	// Undoes EncodeStrip, into interleaved RGB displacements
+	inline void DecodeStrip(float* displacement, const unsigned char* src, int width, int stripRows, int bits, const float scale[3])
+	{
+		const size_t planeSize = size_t(width) * size_t(stripRows);
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const unsigned char* plane = &src[planeSize * channel * (bits / 8)];
+			for (int y = 0; y < stripRows; ++y)
+			{
+				int value = 0;
+				for (int x = 0; x < width; ++x)
+				{
+					const size_t pixelIndex = size_t(y) * width + x;
+					if (bits == 16)
+						value = (int16_t)uint16_t(value + (plane[pixelIndex] | (plane[planeSize + pixelIndex] << 8)));
+					else
+						value = (int8_t)uint8_t(value + plane[pixelIndex]);
+					displacement[pixelIndex * 3 + channel] = float(value) * scale[channel];
+				}
+			}
+		}
+	}
+}
+
+// Writes result - src as a displacement field. Both are width * height RGB floats. The strips are compressed in parallel.
+inline bool WriteDisplacementField(const char* fileName, int width, int height, const float* src, const float* result, const DisplacementFieldOptions& options = DisplacementFieldOptions())
+{
+	using namespace DisplacementField;
+
+	const int bits = (options.bits == 8) ? 8 : 16;
+	const int rowsPerStrip = std::max(options.rowsPerStrip, 1);
+	const int numStrips = (height + rowsPerStrip - 1) / rowsPerStrip;
+	const size_t numValues = size_t(width) * size_t(height) * 3;
+
+	// Each channel's scale makes its largest displacement map to the largest quantized value, unless that is finer than minStep
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, c_magic, sizeof(c_magic));
+	header.version = c_version;
+	header.width = uint32_t(width);
+	header.height = uint32_t(height);
+	header.channels = 3;
+	header.bits = uint32_t(bits);
+	header.compressed = (options.compressionLevel > 0) ? 1 : 0;
+	header.rowsPerStrip = uint32_t(rowsPerStrip);
+	header.numStrips = uint32_t(numStrips);
+	for (int channel = 0; channel < 3; ++channel)
+	{
+		float maxDisplacement = 0.0f;
+		for (size_t index = channel; index < numValues; index += 3)
+			maxDisplacement = std::max(maxDisplacement, std::abs(result[index] - src[index]));
+		header.scale[channel] = std::max(maxDisplacement / float((bits == 16) ? 32767 : 127), options.minStep);
+		if (header.scale[channel] <= 0.0f)
+			header.scale[channel] = 1.0f;
+	}
+
+	// Encode and compress the strips in parallel
+	std::vector<std::vector<unsigned char>> strips(numStrips);
+	std::vector<Strip> stripTable(numStrips);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int stripIndex = 0; stripIndex < numStrips; ++stripIndex)
+	{
+		const int stripRows = StripRows(height, rowsPerStrip, stripIndex);
+		const size_t offset = size_t(stripIndex) * rowsPerStrip * width * 3;
+		std::vector<unsigned char> raw(RawStripSize(width, stripRows, bits));
+		EncodeStrip(raw.data(), &src[offset], &result[offset], width, stripRows, bits, header.scale);
+
+		stripTable[stripIndex].rawSize = uint32_t(raw.size());
+		if (header.compressed)
+			strips[stripIndex] = PNGWriter::DeflateChunk(raw.data(), 0, raw.size(), true, options.compressionLevel);
+		else
+			strips[stripIndex].swap(raw);
+		stripTable[stripIndex].storedSize = uint32_t(strips[stripIndex].size());
+	}
+
+	uint64_t offset = sizeof(Header) + sizeof(Strip) * numStrips;
+	for (Strip& strip : stripTable)
+	{
+		strip.offset = offset;
+		offset += strip.storedSize;
+	}
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	bool ret = fwrite(&header, sizeof(header), 1, file) == 1;
+	ret &= fwrite(stripTable.data(), sizeof(Strip), stripTable.size(), file) == stripTable.size();
+	for (const std::vector<unsigned char>& strip : strips)
+		ret &= fwrite(strip.data(), 1, strip.size(), file) == strip.size();
+	ret &= fclose(file) == 0;
+	return ret;
+}
+
+// Reads a displacement field a strip at a time. Each strip is seeked to through the strip table, so any strip can be
+// read on its own, in any order.
+struct DisplacementFieldReader
+{
+	DisplacementFieldReader() = default;
+	DisplacementFieldReader(const DisplacementFieldReader&) = delete;
+	DisplacementFieldReader& operator=(const DisplacementFieldReader&) = delete;
+
+	~DisplacementFieldReader()
+	{
+		Close();
+	}
+
+	bool Open(const char* fileName)
+	{
+		using namespace DisplacementField;
+
+		Close();
+		fopen_s(&file, fileName, "rb");
+		if (!file)
+			return false;
+
+		_fseeki64(file, 0, SEEK_END);
+		fileSize = _ftelli64(file);
+		_fseeki64(file, 0, SEEK_SET);
+
+		if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, c_magic, sizeof(c_magic)) != 0 ||
+			header.version != c_version || header.channels != 3 || (header.bits != 8 && header.bits != 16) ||
+			header.rowsPerStrip == 0 || header.numStrips != (header.height + header.rowsPerStrip - 1) / header.rowsPerStrip)
+		{
+			Close();
+			return false;
+		}
+
+		stripTable.resize(header.numStrips);
+		if (fread(stripTable.data(), sizeof(Strip), stripTable.size(), file) != stripTable.size())
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+		if (file)
+			fclose(file);
+		file = nullptr;
+		fileSize = 0;
+		stripTable.clear();
+	}
+
+	int Width() const { return int(header.width); }
+	int Height() const { return int(header.height); }
+	int RowsPerStrip() const { return int(header.rowsPerStrip); }
+	int NumStrips() const { return int(header.numStrips); }
+	int64_t FileSize() const { return fileSize; }
+
+	int StripRows(int stripIndex) const
+	{
+		return DisplacementField::StripRows(Height(), RowsPerStrip(), stripIndex);
+	}
+
+	// Reads a strip as interleaved RGB displacements. displacement needs room for Width() * RowsPerStrip() * 3 floats.
+	bool ReadStrip(int stripIndex, float* displacement)
+	{
+		using namespace DisplacementField;
+
+		const Strip& strip = stripTable[stripIndex];
+		const int stripRows = StripRows(stripIndex);
+		if (strip.rawSize != RawStripSize(Width(), stripRows, int(header.bits)))
+			return false;
+
+		// stb_image's inflate looks ahead past the end of the stream, so it gets some zero padding to read
+		stored.assign(size_t(strip.storedSize) + c_inflatePadding, 0);
+		if (_fseeki64(file, int64_t(strip.offset), SEEK_SET) != 0 || fread(stored.data(), 1, strip.storedSize, file) != strip.storedSize)
+			return false;
+
+		const unsigned char* raw = stored.data();
+		if (header.compressed)
+		{
+			decompressed.resize(strip.rawSize);
+			int size = stbi_zlib_decode_noheader_buffer((char*)decompressed.data(), int(decompressed.size()), (const char*)stored.data(), int(stored.size()));
+			if (size != int(strip.rawSize))
+				return false;
+			raw = decompressed.data();
+		}
+		else if (strip.storedSize != strip.rawSize)
+		{
+			return false;
+		}
+
+		DecodeStrip(displacement, raw, Width(), stripRows, int(header.bits), header.scale);
+		return true;
+	}
+
+	DisplacementField::Header header = {};
+	std::vector<DisplacementField::Strip> stripTable;
+	std::vector<unsigned char> stored;
+	std::vector<unsigned char> decompressed;
+
+private:
+	FILE* file = nullptr;
+	int64_t fileSize = 0;
+};
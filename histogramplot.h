@@ -0,0 +1,257 @@
+#pragma once
+
+// Color histograms of RGB images, and plots of them like MakeHistogram.py used to make with matplotlib:
+// a red, green and blue line of pixel counts for each color value, with the y axis going up to a fixed limit
+// so that plots of different images can be compared.
+// The plots are written with stbi_write_png, so stb_image_write.h needs to be included before this.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+struct ColorHistogram
+{
+	uint32_t counts[3][256] = {};
+};
+
+// Adds 3 channel RGB pixels to a histogram
+inline void AddToHistogram(ColorHistogram& histogram, const unsigned char* pixels, size_t numPixels)
+{
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		histogram.counts[0][pixels[i * 3 + 0]]++;
+		histogram.counts[1][pixels[i * 3 + 1]]++;
+		histogram.counts[2][pixels[i * 3 + 2]]++;
+	}
+}
+
+namespace HistogramPlot
+{
+	static const int c_width = 640;
+	static const int c_height = 480;
+	static const int c_left = 100;      // the plot area, inside of the axis labels
+	static const int c_right = 620;
+	static const int c_top = 40;
+	static const int c_bottom = 420;
+	static const int c_textScale = 2;   // how many pixels each font pixel is
+
+	static const int c_glyphWidth = 5;
+	static const int c_glyphHeight = 7;
+
+	// A 5x7 font, with just the characters the plot uses. Each row is 5 bits, with the leftmost pixel in the high bit.
+	struct Glyph
+	{
+		char c;
+		unsigned char rows[c_glyphHeight];
+	};
+
+	static const Glyph c_font[] = {
+		{ '0', { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E } },
+		{ '1', { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+		{ '2', { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F } },
+		{ '3', { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E } },
+		{ '4', { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 } },
+		{ '5', { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E } },
+		{ '6', { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E } },
+		{ '7', { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+		{ '8', { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E } },
+		{ '9', { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C } },
+		{ 'C', { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E } },
+		{ 'H', { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+		{ 'P', { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 } },
+		{ 'a', { 0x00, 0x00, 0x0E, 0x01, 0x0F, 0x11, 0x0F } },
+		{ 'c', { 0x00, 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E } },
+		{ 'e', { 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x10, 0x0E } },
+		{ 'g', { 0x00, 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x0E } },
+		{ 'i', { 0x04, 0x00, 0x0C, 0x04, 0x04, 0x04, 0x0E } },
+		{ 'l', { 0x0C, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+		{ 'm', { 0x00, 0x00, 0x1A, 0x15, 0x15, 0x11, 0x11 } },
+		{ 'n', { 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 } },
+		{ 'o', { 0x00, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E } },
+		{ 'r', { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 } },
+		{ 's', { 0x00, 0x00, 0x0E, 0x10, 0x0E, 0x01, 0x1E } },
+		{ 't', { 0x08, 0x08, 0x1C, 0x08, 0x08, 0x09, 0x06 } },
+		{ 'u', { 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0D } },
+		{ 'v', { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0A, 0x04 } },
+		{ 'x', { 0x00, 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11 } },
+	};
+
+	struct Color
+	{
+		unsigned char r, g, b;
+	};
+
+	static const Color c_black = { 0, 0, 0 };
+	static const Color c_lineColors[3] = { { 255, 0, 0 }, { 0, 128, 0 }, { 0, 0, 255 } };
+
+	struct Canvas
+	{
+		Canvas()
+			: pixels(size_t(c_width) * c_height * 3, 255)
+		{
+		}
+
+		void SetPixel(int x, int y, Color color)
+		{
+			if (x < 0 || y < 0 || x >= c_width || y >= c_height)
+				return;
+			unsigned char* pixel = &pixels[(size_t(y) * c_width + x) * 3];
+			pixel[0] = color.r;
+			pixel[1] = color.g;
+			pixel[2] = color.b;
+		}
+
+		void FillRect(int x0, int y0, int x1, int y1, Color color)
+		{
+			for (int y = y0; y <= y1; ++y)
+				for (int x = x0; x <= x1; ++x)
+					SetPixel(x, y, color);
+		}
+
+		// Draws text with its top left at x, y. Vertical text goes upwards from x, y, which is then its bottom left.
+		void DrawText(int x, int y, const char* text, bool vertical = false)
+		{
+			for (int charIndex = 0; text[charIndex]; ++charIndex)
+			{
+				const Glyph* glyph = nullptr;
+				for (const Glyph& candidate : c_font)
+				{
+					if (candidate.c == text[charIndex])
+						glyph = &candidate;
+				}
+
+				if (glyph)
+				{
+					for (int row = 0; row < c_glyphHeight; ++row)
+					{
+						for (int column = 0; column < c_glyphWidth; ++column)
+						{
+							if (!(glyph->rows[row] & (0x10 >> column)))
+								continue;
+
+							const int across = (charIndex * (c_glyphWidth + 1) + column) * c_textScale;
+							const int down = row * c_textScale;
+							if (vertical)
+								FillRect(x + down, y - across - c_textScale + 1, x + down + c_textScale - 1, y - across, c_black);
+							else
+								FillRect(x + across, y + down, x + across + c_textScale - 1, y + down + c_textScale - 1, c_black);
+						}
+					}
+				}
+			}
+		}
+
+		// Draws a line, two pixels thick, clipped to the plot area
+		void DrawLine(float x0, float y0, float x1, float y1, Color color)
+		{
+			// Clip the line to the top and bottom of the plot area
+			float t0 = 0.0f;
+			float t1 = 1.0f;
+			const float dy = y1 - y0;
+			for (float edge : { float(c_top), float(c_bottom) })
+			{
+				if (dy == 0.0f)
+					continue;
+				const float t = (edge - y0) / dy;
+				const bool entering = (edge == c_top) ? (dy > 0.0f) : (dy < 0.0f);
+				if (entering)
+					t0 = std::max(t0, t);
+				else
+					t1 = std::min(t1, t);
+			}
+			if (y0 == y1 && (y0 < c_top || y0 > c_bottom))
+				return;
+			if (t0 > t1)
+				return;
+
+			const float ax = x0 + (x1 - x0) * t0;
+			const float ay = y0 + dy * t0;
+			const float bx = x0 + (x1 - x0) * t1;
+			const float by = y0 + dy * t1;
+
+			const int steps = std::max(1, int(std::ceil(std::max(std::abs(bx - ax), std::abs(by - ay)))));
+			for (int step = 0; step <= steps; ++step)
+			{
+				const float t = float(step) / float(steps);
+				const int x = int(std::lround(ax + (bx - ax) * t));
+				const int y = int(std::lround(ay + (by - ay) * t));
+				SetPixel(x, y, color);
+				SetPixel(x, y + 1, color);
+			}
+		}
+
+		std::vector<unsigned char> pixels;
+	};
+
+	inline int TextWidth(const char* text)
+	{
+		return int(strlen(text)) * (c_glyphWidth + 1) * c_textScale;
+	}
+
+	// A tick spacing of 1, 2, 2.5 or 5 times a power of 10, which gives at most 8 ticks
+	inline double TickStep(double range)
+	{
+		const double magnitude = pow(10.0, floor(log10(std::max(range, 1.0) / 8.0)));
+		for (double multiple : { 1.0, 2.0, 2.5, 5.0, 10.0 })
+		{
+			if (range / (magnitude * multiple) <= 8.0)
+				return magnitude * multiple;
+		}
+		return magnitude * 10.0;
+	}
+}
+
+// Draws the histogram as a plot like MakeHistogram.py did, and writes it as a PNG. Counts above yLimit are off the top.
+inline bool WriteHistogramPlot(const char* fileName, const ColorHistogram& histogram, float yLimit)
+{
+	using namespace HistogramPlot;
+
+	Canvas canvas;
+	auto PlotX = [] (double value) { return float(c_left + (c_right - c_left) * value / 256.0); };
+	auto PlotY = [yLimit] (double count) { return float(c_bottom - (c_bottom - c_top) * count / std::max(double(yLimit), 1.0)); };
+
+	// The lines
+	for (int channel = 0; channel < 3; ++channel)
+	{
+		for (int value = 0; value + 1 < 256; ++value)
+			canvas.DrawLine(PlotX(value), PlotY(histogram.counts[channel][value]), PlotX(value + 1), PlotY(histogram.counts[channel][value + 1]), c_lineColors[channel]);
+	}
+
+	// The frame
+	canvas.FillRect(c_left, c_top, c_right, c_top, c_black);
+	canvas.FillRect(c_left, c_bottom, c_right, c_bottom, c_black);
+	canvas.FillRect(c_left, c_top, c_left, c_bottom, c_black);
+	canvas.FillRect(c_right, c_top, c_right, c_bottom, c_black);
+
+	// The ticks and their labels
+	char label[64];
+	for (int value = 0; value < 256; value += 50)
+	{
+		const int x = int(PlotX(value));
+		canvas.FillRect(x, c_bottom, x, c_bottom + 4, c_black);
+		snprintf(label, sizeof(label), "%i", value);
+		canvas.DrawText(x - TextWidth(label) / 2, c_bottom + 8, label);
+	}
+
+	const double yStep = TickStep(yLimit);
+	for (double count = 0.0; count <= double(yLimit) + yStep * 0.001; count += yStep)
+	{
+		const int y = int(std::lround(PlotY(count)));
+		canvas.FillRect(c_left - 4, y, c_left, y, c_black);
+		snprintf(label, sizeof(label), "%.0f", count);
+		canvas.DrawText(c_left - 8 - TextWidth(label), y - c_glyphHeight * c_textScale / 2, label);
+	}
+
+	// The title and axis labels
+	const char* title = "Color Histogram";
+	const char* xLabel = "Color value";
+	const char* yLabel = "Pixel count";
+	canvas.DrawText((c_left + c_right - TextWidth(title)) / 2, c_top - 24, title);
+	canvas.DrawText((c_left + c_right - TextWidth(xLabel)) / 2, c_bottom + 34, xLabel);
+	canvas.DrawText(8, (c_top + c_bottom + TextWidth(yLabel)) / 2, yLabel, true);
+
+	return stbi_write_png(fileName, c_width, c_height, 3, canvas.pixels.data(), c_width * 3) != 0;
+}
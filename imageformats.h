@@ -0,0 +1,391 @@
+#pragma once
+
+// Fast lossless image formats, for intermediate results that are written and then read again right away.
+// QOI is lossless 8 bit and much faster than PNG. PPM is raw 8 bit. PFM is raw float, so it needs no quantization.
+// These all work with 3 channel RGB.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+// Returns true if the file name ends in ".extension", ignoring case
+inline bool HasExtension(const char* fileName, const char* extension)
+{
+	const char* dot = strrchr(fileName, '.');
+	if (!dot)
+		return false;
+
+	const char* a = dot + 1;
+	const char* b = extension;
+	while (*a && *b && tolower(*a) == tolower(*b))
+	{
+		a++;
+		b++;
+	}
+	return *a == 0 && *b == 0;
+}
+
+// Reads a whole file. The size is 64 bit, since a PFM of a big image can be more than 2GB.
+inline bool ReadFile(const char* fileName, std::vector<unsigned char>& data)
+{
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "rb");
+	if (!file)
+		return false;
+
+	_fseeki64(file, 0, SEEK_END);
+	int64_t size = _ftelli64(file);
+	_fseeki64(file, 0, SEEK_SET);
+	data.resize(size > 0 ? size_t(size) : 0);
+	bool ret = fread(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return ret;
+}
+
+// ===================== QOI =====================
+// See https://qoiformat.org/qoi-specification.pdf
+
+namespace QOI
+{
+	static const unsigned char c_opIndex = 0x00;
+	static const unsigned char c_opDiff = 0x40;
+	static const unsigned char c_opLuma = 0x80;
+	static const unsigned char c_opRun = 0xc0;
+	static const unsigned char c_opRGB = 0xfe;
+	static const unsigned char c_opRGBA = 0xff;
+	static const unsigned char c_mask = 0xc0;
+	static const unsigned char c_endMarker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+	struct Pixel
+	{
+		unsigned char r = 0, g = 0, b = 0, a = 255;
+
+		bool operator == (const Pixel& other) const
+		{
+			return r == other.r && g == other.g && b == other.b && a == other.a;
+		}
+	};
+
+	inline int Hash(const Pixel& p)
+	{
+		return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+	}
+
+	inline void Write32(std::vector<unsigned char>& data, uint32_t value)
+	{
+		data.push_back((unsigned char)(value >> 24));
+		data.push_back((unsigned char)(value >> 16));
+		data.push_back((unsigned char)(value >> 8));
+		data.push_back((unsigned char)value);
+	}
+
+	inline uint32_t Read32(const unsigned char* data)
+	{
+		return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+	}
+}
+
+// Writes a QOI file a few rows at a time. The run, the previous pixel and the index carry over from one call to the
+// next, so the file is the same as encoding the whole image at once.
+struct QOIStreamWriter
+{
+	QOIStreamWriter() = default;
+	QOIStreamWriter(const QOIStreamWriter&) = delete;
+	QOIStreamWriter& operator=(const QOIStreamWriter&) = delete;
+
+	~QOIStreamWriter()
+	{
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool Open(const char* fileName, int width, int height)
+	{
+		using namespace QOI;
+
+		fopen_s(&m_file, fileName, "wb");
+		if (!m_file)
+			return false;
+
+		m_numPixels = size_t(width) * size_t(height);
+		m_pixelsWritten = 0;
+		m_previous = Pixel();
+		m_run = 0;
+
+		// The index starts out as all zeros, alpha included
+		for (Pixel& indexPixel : m_index)
+		{
+			indexPixel = Pixel();
+			indexPixel.a = 0;
+		}
+
+		m_data.clear();
+		m_data.insert(m_data.end(), { 'q', 'o', 'i', 'f' });
+		Write32(m_data, uint32_t(width));
+		Write32(m_data, uint32_t(height));
+		m_data.push_back(3); // channels
+		m_data.push_back(0); // sRGB with linear alpha
+		return Flush();
+	}
+
+	// Adds 3 channel RGB pixels, in order
+	bool WritePixels(const unsigned char* pixels, size_t count)
+	{
+		using namespace QOI;
+
+		count = std::min(count, m_numPixels - m_pixelsWritten);
+		m_data.reserve(m_data.size() + count * 4);
+		for (size_t i = 0; i < count; ++i)
+		{
+			Pixel pixel;
+			pixel.r = pixels[i * 3 + 0];
+			pixel.g = pixels[i * 3 + 1];
+			pixel.b = pixels[i * 3 + 2];
+			m_pixelsWritten++;
+
+			if (pixel == m_previous)
+			{
+				m_run++;
+				if (m_run == 62 || m_pixelsWritten == m_numPixels)
+				{
+					m_data.push_back((unsigned char)(c_opRun | (m_run - 1)));
+					m_run = 0;
+				}
+				continue;
+			}
+
+			if (m_run > 0)
+			{
+				m_data.push_back((unsigned char)(c_opRun | (m_run - 1)));
+				m_run = 0;
+			}
+
+			int hash = Hash(pixel);
+			if (m_index[hash] == pixel)
+			{
+				m_data.push_back((unsigned char)(c_opIndex | hash));
+			}
+			else
+			{
+				m_index[hash] = pixel;
+
+				signed char dr = (signed char)(pixel.r - m_previous.r);
+				signed char dg = (signed char)(pixel.g - m_previous.g);
+				signed char db = (signed char)(pixel.b - m_previous.b);
+				signed char drg = (signed char)(dr - dg);
+				signed char dbg = (signed char)(db - dg);
+
+				if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+				{
+					m_data.push_back((unsigned char)(c_opDiff | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)));
+				}
+				else if (drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8)
+				{
+					m_data.push_back((unsigned char)(c_opLuma | (dg + 32)));
+					m_data.push_back((unsigned char)(((drg + 8) << 4) | (dbg + 8)));
+				}
+				else
+				{
+					m_data.push_back(c_opRGB);
+					m_data.push_back(pixel.r);
+					m_data.push_back(pixel.g);
+					m_data.push_back(pixel.b);
+				}
+			}
+
+			m_previous = pixel;
+		}
+		return Flush();
+	}
+
+	bool Close()
+	{
+		if (!m_file)
+			return false;
+
+		m_data.insert(m_data.end(), QOI::c_endMarker, QOI::c_endMarker + 8);
+		bool ret = Flush() && (m_pixelsWritten == m_numPixels);
+		ret &= (fclose(m_file) == 0);
+		m_file = nullptr;
+		return ret;
+	}
+
+	// Writes the encoded bytes to the file
+	bool Flush()
+	{
+		bool ret = fwrite(m_data.data(), 1, m_data.size(), m_file) == m_data.size();
+		m_data.clear();
+		return ret;
+	}
+
+	FILE* m_file = nullptr;
+	size_t m_numPixels = 0;
+	size_t m_pixelsWritten = 0;
+	QOI::Pixel m_index[64];
+	QOI::Pixel m_previous;
+	int m_run = 0;
+	std::vector<unsigned char> m_data;
+};
+
+inline bool WriteQOI(const char* fileName, int width, int height, const unsigned char* pixels)
+{
+	QOIStreamWriter writer;
+	return writer.Open(fileName, width, height) && writer.WritePixels(pixels, size_t(width) * size_t(height)) && writer.Close();
+}
+
+// Reads a QOI file as 3 channel RGB
+inline bool ReadQOI(const char* fileName, int& width, int& height, std::vector<unsigned char>& pixels)
+{
+	using namespace QOI;
+
+	std::vector<unsigned char> data;
+	if (!ReadFile(fileName, data) || data.size() < 14 + 8 || memcmp(data.data(), "qoif", 4) != 0)
+		return false;
+
+	width = int(Read32(&data[4]));
+	height = int(Read32(&data[8]));
+	if (width <= 0 || height <= 0)
+		return false;
+
+	const size_t numPixels = size_t(width) * size_t(height);
+	pixels.resize(numPixels * 3);
+
+	// The index starts out as all zeros, alpha included
+	Pixel index[64];
+	for (Pixel& indexPixel : index)
+		indexPixel.a = 0;
+	Pixel pixel;
+	int run = 0;
+	size_t pos = 14;
+	const size_t end = data.size() - 8;
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		if (run > 0)
+		{
+			run--;
+		}
+		else if (pos < end)
+		{
+			unsigned char op = data[pos++];
+			if (op == c_opRGB)
+			{
+				pixel.r = data[pos++];
+				pixel.g = data[pos++];
+				pixel.b = data[pos++];
+			}
+			else if (op == c_opRGBA)
+			{
+				pixel.r = data[pos++];
+				pixel.g = data[pos++];
+				pixel.b = data[pos++];
+				pixel.a = data[pos++];
+			}
+			else if ((op & c_mask) == c_opIndex)
+			{
+				pixel = index[op];
+			}
+			else if ((op & c_mask) == c_opDiff)
+			{
+				pixel.r += ((op >> 4) & 0x03) - 2;
+				pixel.g += ((op >> 2) & 0x03) - 2;
+				pixel.b += (op & 0x03) - 2;
+			}
+			else if ((op & c_mask) == c_opLuma)
+			{
+				unsigned char next = data[pos++];
+				int dg = (op & 0x3f) - 32;
+				pixel.r += dg - 8 + ((next >> 4) & 0x0f);
+				pixel.g += dg;
+				pixel.b += dg - 8 + (next & 0x0f);
+			}
+			else
+			{
+				run = op & 0x3f;
+			}
+
+			index[Hash(pixel)] = pixel;
+		}
+
+		pixels[i * 3 + 0] = pixel.r;
+		pixels[i * 3 + 1] = pixel.g;
+		pixels[i * 3 + 2] = pixel.b;
+	}
+	return true;
+}
+
+// ===================== PPM / PFM =====================
+
+inline bool WritePPM(const char* fileName, int width, int height, const unsigned char* pixels)
+{
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "P6\n%i %i\n255\n", width, height);
+	const size_t size = size_t(width) * size_t(height) * 3;
+	bool ret = fwrite(pixels, 1, size, file) == size;
+	fclose(file);
+	return ret;
+}
+
+// PFM is little endian when the scale is negative, and the rows go from bottom to top
+inline bool WritePFM(const char* fileName, int width, int height, const float* pixels)
+{
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "PF\n%i %i\n-1.0\n", width, height);
+	bool ret = true;
+	for (int y = height - 1; y >= 0; --y)
+		ret &= fwrite(&pixels[size_t(y) * width * 3], sizeof(float), size_t(width) * 3, file) == size_t(width) * 3;
+	fclose(file);
+	return ret;
+}
+
+inline bool ReadPFM(const char* fileName, int& width, int& height, std::vector<float>& pixels)
+{
+	std::vector<unsigned char> data;
+	if (!ReadFile(fileName, data))
+		return false;
+	data.push_back(0);
+
+	// The header is "PF", the width and height, and the scale, with a single whitespace character after the scale
+	const char* header = (const char*)data.data();
+	if (header[0] != 'P' || header[1] != 'F')
+		return false;
+	char* end = nullptr;
+	width = (int)strtol(&header[2], &end, 10);
+	height = (int)strtol(end, &end, 10);
+	float scale = strtof(end, &end);
+	const size_t headerSize = size_t(end - header) + 1;
+	data.pop_back();
+
+	const size_t numValues = size_t(width) * size_t(height) * 3;
+	if (width <= 0 || height <= 0 || data.size() < headerSize + numValues * sizeof(float))
+		return false;
+
+	pixels.resize(numValues);
+	const unsigned char* src = &data[headerSize];
+	for (int y = 0; y < height; ++y)
+		memcpy(&pixels[size_t(height - 1 - y) * width * 3], &src[size_t(y) * width * 3 * sizeof(float)], size_t(width) * 3 * sizeof(float));
+
+	// A positive scale means big endian
+	if (scale > 0.0f)
+	{
+		for (float& value : pixels)
+		{
+			uint32_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			bits = (bits >> 24) | ((bits >> 8) & 0xFF00) | ((bits << 8) & 0xFF0000) | (bits << 24);
+			memcpy(&value, &bits, sizeof(bits));
+		}
+	}
+	return true;
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+// 3D joint histograms of RGB colors, with 2^bits bins per channel, from 1 to 8 bits (2^3 to 256^3 bins).
+// Only the bins which have pixels in them are kept, as a list sorted by bin index, so even 256^3 is small.
+// They are made in parallel. Each thread counts its part of the image into private bins, and then the bins are merged.
+// With up to c_maxDenseBits bits, the private bins are a dense array. With more, each thread sorts its bin indices instead.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#include "imageformats.h"
+
+struct JointHistogramBin
+{
+	uint32_t index;   // (r << (bits * 2)) | (g << bits) | b, where r, g and b are the color values shifted down to bits
+	uint32_t count;
+};
+
+struct JointHistogram
+{
+	int bits = 0;
+	uint64_t totalCount = 0;
+	std::vector<JointHistogramBin> bins;
+
+	// Returns how many pixels fell into the bin of a color
+	uint32_t Count(unsigned char r, unsigned char g, unsigned char b) const
+	{
+		const int shift = 8 - bits;
+		const uint32_t index = (uint32_t(r >> shift) << (bits * 2)) | (uint32_t(g >> shift) << bits) | uint32_t(b >> shift);
+		auto it = std::lower_bound(bins.begin(), bins.end(), index, [] (const JointHistogramBin& bin, uint32_t value) { return bin.index < value; });
+		return (it != bins.end() && it->index == index) ? it->count : 0;
+	}
+};
+
+namespace JointHistogramDetail
+{
+	static const int c_maxDenseBits = 6;              // 64^3 bins of uint32 is 1MB per thread
+	static const char c_magic[8] = { 'S', 'O', 'T', 'J', 'H', 'I', 'S', 'T' };
+	static const uint32_t c_version = 1;
+
+	inline unsigned char ToU8(unsigned char value)
+	{
+		return value;
+	}
+
+	// Float values are clamped and truncated, like SaveFloatImage does
+	inline unsigned char ToU8(float value)
+	{
+		return (unsigned char)std::max(std::min(value, 255.0f), 0.0f);
+	}
+
+	template <typename T>
+	inline uint32_t BinIndex(const T* pixel, int bits)
+	{
+		const int shift = 8 - bits;
+		return (uint32_t(ToU8(pixel[0]) >> shift) << (bits * 2)) | (uint32_t(ToU8(pixel[1]) >> shift) << bits) | uint32_t(ToU8(pixel[2]) >> shift);
+	}
+
+	// Sorts bin indices of up to 24 bits, with least significant digit first radix sort, 12 bits at a time
+	inline void RadixSortIndices(std::vector<uint32_t>& keys, std::vector<uint32_t>& scratch, int keyBits)
+	{
+		const int c_digitBits = 12;
+		const uint32_t c_digitMask = (1 << c_digitBits) - 1;
+		scratch.resize(keys.size());
+		std::vector<uint32_t> offsets(size_t(1) << c_digitBits);
+		for (int shift = 0; shift < keyBits; shift += c_digitBits)
+		{
+			std::fill(offsets.begin(), offsets.end(), 0);
+			for (uint32_t key : keys)
+				offsets[(key >> shift) & c_digitMask]++;
+
+			uint32_t offset = 0;
+			for (uint32_t& count : offsets)
+			{
+				const uint32_t digitCount = count;
+				count = offset;
+				offset += digitCount;
+			}
+
+			for (uint32_t key : keys)
+				scratch[offsets[(key >> shift) & c_digitMask]++] = key;
+			keys.swap(scratch);
+		}
+	}
+
+	// Merges two sorted bin lists, adding the counts of bins that are in both
+	inline void MergeBins(std::vector<JointHistogramBin>& dest, const std::vector<JointHistogramBin>& a, const std::vector<JointHistogramBin>& b)
+	{
+		dest.clear();
+		dest.reserve(a.size() + b.size());
+		size_t i = 0, j = 0;
+		while (i < a.size() && j < b.size())
+		{
+			if (a[i].index < b[j].index)
+				dest.push_back(a[i++]);
+			else if (b[j].index < a[i].index)
+				dest.push_back(b[j++]);
+			else
+			{
+				dest.push_back({ a[i].index, a[i].count + b[j].count });
+				i++;
+				j++;
+			}
+		}
+		dest.insert(dest.end(), a.begin() + i, a.end());
+		dest.insert(dest.end(), b.begin() + j, b.end());
+	}
+
+	inline void WriteVarint(std::vector<unsigned char>& data, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			data.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		data.push_back((unsigned char)value);
+	}
+
+	inline bool ReadVarint(const std::vector<unsigned char>& data, size_t& pos, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && pos < data.size(); shift += 7)
+		{
+			unsigned char byte = data[pos++];
+			value |= uint64_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+}
+
+// Makes the joint histogram of 3 channel RGB pixels, which are uint8 or float
+template <typename T>
+void BuildJointHistogram(JointHistogram& histogram, const T* pixels, size_t numPixels, int bits)
+{
+	using namespace JointHistogramDetail;
+
+	bits = std::max(std::min(bits, 8), 1);
+	histogram.bits = bits;
+	histogram.totalCount = numPixels;
+	histogram.bins.clear();
+
+	const int numThreads = std::max(omp_get_max_threads(), 1);
+	const size_t pixelsPerThread = (numPixels + numThreads - 1) / numThreads;
+
+	if (bits <= c_maxDenseBits)
+	{
+		// Count into a dense array per thread, then sum the arrays, in parallel over ranges of bins
+		const size_t numBins = size_t(1) << (bits * 3);
+		std::vector<std::vector<uint32_t>> threadBins(numThreads);
+
+		#pragma omp parallel for num_threads(numThreads)
+		for (int thread = 0; thread < numThreads; ++thread)
+		{
+			std::vector<uint32_t>& counts = threadBins[thread];
+			counts.assign(numBins, 0);
+			const size_t begin = std::min(size_t(thread) * pixelsPerThread, numPixels);
+			const size_t end = std::min(begin + pixelsPerThread, numPixels);
+			for (size_t pixelIndex = begin; pixelIndex < end; ++pixelIndex)
+				counts[BinIndex(&pixels[pixelIndex * 3], bits)]++;
+		}
+
+		const int numRanges = numThreads;
+		const size_t binsPerRange = (numBins + numRanges - 1) / numRanges;
+		std::vector<std::vector<JointHistogramBin>> rangeBins(numRanges);
+
+		#pragma omp parallel for num_threads(numThreads)
+		for (int range = 0; range < numRanges; ++range)
+		{
+			const size_t begin = std::min(size_t(range) * binsPerRange, numBins);
+			const size_t end = std::min(begin + binsPerRange, numBins);
+			for (size_t binIndex = begin; binIndex < end; ++binIndex)
+			{
+				uint32_t count = 0;
+				for (const std::vector<uint32_t>& counts : threadBins)
+					count += counts[binIndex];
+				if (count > 0)
+					rangeBins[range].push_back({ uint32_t(binIndex), count });
+			}
+		}
+
+		for (const std::vector<JointHistogramBin>& bins : rangeBins)
+			histogram.bins.insert(histogram.bins.end(), bins.begin(), bins.end());
+		return;
+	}
+
+	// Each thread sorts the bin indices of its pixels and counts the runs, then the sorted lists are merged in pairs
+	std::vector<std::vector<JointHistogramBin>> threadBins(numThreads);
+
+	#pragma omp parallel for num_threads(numThreads)
+	for (int thread = 0; thread < numThreads; ++thread)
+	{
+		const size_t begin = std::min(size_t(thread) * pixelsPerThread, numPixels);
+		const size_t end = std::min(begin + pixelsPerThread, numPixels);
+		std::vector<uint32_t> indices(end - begin);
+		std::vector<uint32_t> scratch;
+		for (size_t pixelIndex = begin; pixelIndex < end; ++pixelIndex)
+			indices[pixelIndex - begin] = BinIndex(&pixels[pixelIndex * 3], bits);
+		RadixSortIndices(indices, scratch, bits * 3);
+
+		std::vector<JointHistogramBin>& bins = threadBins[thread];
+		for (uint32_t index : indices)
+		{
+			if (!bins.empty() && bins.back().index == index)
+				bins.back().count++;
+			else
+				bins.push_back({ index, 1 });
+		}
+	}
+
+	for (int step = 1; step < numThreads; step *= 2)
+	{
+		#pragma omp parallel for num_threads(numThreads)
+		for (int thread = 0; thread < numThreads; thread += step * 2)
+		{
+			if (thread + step >= numThreads)
+				continue;
+			std::vector<JointHistogramBin> merged;
+			MergeBins(merged, threadBins[thread], threadBins[thread + step]);
+			threadBins[thread].swap(merged);
+			std::vector<JointHistogramBin>().swap(threadBins[thread + step]);
+		}
+	}
+	histogram.bins.swap(threadBins[0]);
+}
+
+// Writes a joint histogram. The bins are stored as the difference from the previous bin's index, and the count,
+// both as variable length integers, so most bins take 2 to 4 bytes.
+inline bool WriteJointHistogram(const char* fileName, const JointHistogram& histogram)
+{
+	using namespace JointHistogramDetail;
+
+	std::vector<unsigned char> data(c_magic, c_magic + sizeof(c_magic));
+	WriteVarint(data, c_version);
+	WriteVarint(data, uint64_t(histogram.bits));
+	WriteVarint(data, histogram.totalCount);
+	WriteVarint(data, histogram.bins.size());
+	uint32_t previousIndex = 0;
+	for (const JointHistogramBin& bin : histogram.bins)
+	{
+		WriteVarint(data, bin.index - previousIndex);
+		WriteVarint(data, bin.count);
+		previousIndex = bin.index;
+	}
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+	bool ret = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ret &= fclose(file) == 0;
+	return ret;
+}
+
+inline bool ReadJointHistogram(const char* fileName, JointHistogram& histogram)
+{
+	using namespace JointHistogramDetail;
+
+	std::vector<unsigned char> data;
+	if (!ReadFile(fileName, data) || data.size() < sizeof(c_magic) || memcmp(data.data(), c_magic, sizeof(c_magic)) != 0)
+		return false;
+
+	size_t pos = sizeof(c_magic);
+	uint64_t version, bits, totalCount, numBins;
+	if (!ReadVarint(data, pos, version) || version != c_version || !ReadVarint(data, pos, bits) || bits < 1 || bits > 8 ||
+		!ReadVarint(data, pos, totalCount) || !ReadVarint(data, pos, numBins) || numBins > data.size())
+	{
+		return false;
+	}
+
+	histogram.bits = int(bits);
+	histogram.totalCount = totalCount;
+	histogram.bins.resize(size_t(numBins));
+	uint64_t index = 0;
+	for (JointHistogramBin& bin : histogram.bins)
+	{
+		uint64_t delta, count;
+		if (!ReadVarint(data, pos, delta) || !ReadVarint(data, pos, count))
+			return false;
+		index += delta;
+		bin.index = uint32_t(index);
+		bin.count = uint32_t(count);
+	}
+	return true;
+}
@@ -4,6 +4,50 @@
 #define DETERMINISTIC() true
 static const int c_numIterations = 100;
 static const int c_batchSize = 16;
+static const size_t c_memoryBudgetBytes = 0; // The most working memory SlicedOptimalTransport may use. 0 means no limit.
+#define SOT_STORAGE() SOTStorage::Float32 // Float32, Float16, BFloat16 or FixedPoint. The 16 bit types shrink the working memory.
+#define STORAGE_ACCURACY_REPORT() false // If true, also solves with fp32 storage and reports how much the SOT_STORAGE() results differ
+#define TARGET_PROJECTION_LUT() false // If true, the uint8 target is projected with per direction lookup tables instead of SIMD
+#define STAGE_TIMING() true // If true, SlicedOptimalTransport times each stage of each iteration and writes the times to the CSV
+#define TRACING() false // If true, a timeline of the solver stages and image jobs on each thread is written to c_traceFileName
+#if TRACING()
+static const char* c_traceFileName = "out/trace.json"; // Chrome trace JSON, for chrome://tracing or Perfetto
+#endif
+#define PERF_COUNTERS() false // If true, hardware counters are written to the CSV for each solver stage, and reported for each interpolation and save. Linux only.
+#define ROOFLINE_REPORT() false // If true, reports the GB/s and GFLOP/s of the solver stages and interpolations, against what the machine can do. Needs STAGE_TIMING().
+static const char* c_machineRoofFileName = "machineroof.txt"; // In c_transportCacheDir, the measured bandwidth and FLOPs of this machine. Delete it to measure again.
+static const int c_numWriterThreads = 4; // How many threads encode and write output images
+static const size_t c_maxQueuedWrites = 8; // How many output images can wait to be written before SaveFloatImage blocks
+#define TRANSPORT_CACHE() true // If true, optimal transport results are cached on disk and memory mapped on later runs. Needs DETERMINISTIC().
+static const char* c_transportCacheDir = "cache";
+static const int c_transportCacheVersion = 1; // Change this when the solver changes, so old cache files are not used
+#define DISPLACEMENT_FIELDS() false // If true, the optimal transport results are also written as compact displacement fields, and read back to check them
+static const int c_displacementFieldBits = 16; // 16 or 8
+static const size_t c_interpolateBlockSize = 4096; // How many floats the interpolations do at a time. With the source and 3 targets, a block is about 80KB, which fits in the L2 cache.
+#define STREAM_OUTPUT_IMAGES() true // If true, the output images are interpolated and encoded a band of rows at a time, instead of as whole images
+static const int c_streamBandRows = 32;
+#define INTERPOLATE_SEPARATELY() false // If true, and not STREAM_OUTPUT_IMAGES(), each output is made by its own pass over the images, to compare against making them all in one pass
+#define WEIGHT_MAP_OUTPUTS() false // If true, outputs with weights that ramp across the image are also written, from a float weight map and an 8 bit mask
+#define PREVIEW_TIMING_REPORT() false // If true, reports how fast the progressive previews are, and writes the preview of each level to out/
+static const int c_previewLevels = 4; // Full size, 1/2, 1/4 and 1/8
+#define HISTOGRAMS() true // If true, plots of the color histograms of the input and output images are written next to them in out/
+static const float c_histogramYLimit = 12000.0f; // The top of the y axis of the histogram plots, so they can be compared
+#define JOINT_HISTOGRAMS() false // If true, the 3d color histograms of the input images and optimal transport results are written to out/
+static const int c_jointHistogramBits = 6; // Bits per channel, from 5 (32^3 bins) to 8 (256^3 bins)
+#define PROJECTION_CAPTURE() false // If true, the projections of the first batch of c_projectionCaptureIterations are written next to the CSV, for --replay-projections. Cached solves aren't captured.
+static const int c_projectionCaptureIterations[] = { 0, 50, 99 };
+static const int c_replayRuns = 5; // --replay-projections reports the fastest of this many runs of each backend
+static const char* c_benchmarkFileName = "out/benchmark.json"; // Where --benchmark writes its results
+static const int c_benchmarkIterations = 10; // The time of an iteration doesn't depend on how many there are, so benchmarks only do a few
+static const double c_benchmarkMegapixels[] = { 0.1, 0.5, 2.0, 8.0, 32.0 }; // The image sizes of the benchmark's size sweep
+static const double c_benchmarkLargeMegapixels = 200.0; // --benchmark-large adds this size to the size sweep, for the tiled photo only. It takes hours.
+static const double c_benchmarkScalingMegapixels = 2.0; // The image size of the other sweeps, and the size per thread for weak scaling
+static const int c_benchmarkBatchSizes[] = { 4, 8, 16, 32 };
+static const size_t c_benchmarkMemoryBudgetBytes = size_t(8) << 30; // Benchmarks of big images do their batches in waves to stay within this
+
+#if ROOFLINE_REPORT() && !STAGE_TIMING()
+#error ROOFLINE_REPORT() needs STAGE_TIMING(), for the time of each stage
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -11,11 +55,128 @@ static const int c_batchSize = 16;
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
 
+#include "pngwriter.h"
+#include "imageformats.h"
+#include "transportcache.h"
+#include "displacementfield.h"
+#include "histogramplot.h"
+#include "jointhistogram.h"
+#include "trace.h"
+#include "perfcounters.h"
+#include "roofline.h"
+#include "syntheticimages.h"
+#include "projectioncapture.h"
+
 #include <random>
 #include <vector>
 #include <direct.h>
 #include <stdio.h>
 #include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <string.h>
+#include <immintrin.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// Records how long the rest of the scope takes, in the trace
+#if TRACING()
+#define TRACE_SCOPE(name) TraceScope traceScope(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+// Reads the hardware counters of all OpenMP threads added together, which must be done outside of parallel regions,
+// or of only the calling thread
+inline PerfCounterValues ReadPerfCountersOf(bool allThreads)
+{
+	if (allThreads)
+		return ReadPerfCountersAllThreads();
+
+	PerfCounterValues values;
+	ReadPerfCounters(values);
+	return values;
+}
+
+void PrintPerfCounters(const std::string& label, const PerfCounterValues& counted)
+{
+	const uint64_t* values = counted.values;
+	printf("%s: %0.3f G cycles, %0.3f G instructions (%0.2f IPC), %0.3f M LLC misses, %0.3f M dTLB misses\n", label.c_str(),
+		double(values[PerfCounters::Cycles]) / 1e9, double(values[PerfCounters::Instructions]) / 1e9,
+		double(values[PerfCounters::Instructions]) / std::max(double(values[PerfCounters::Cycles]), 1.0),
+		double(values[PerfCounters::LLCMisses]) / 1e6, double(values[PerfCounters::DTLBMisses]) / 1e6);
+}
+
+// Adds what the hardware counters counted, from when it is made to when it goes out of scope, to a total
+struct PerfCounterScope
+{
+	PerfCounterScope(PerfCounterValues& total, bool allThreads)
+		: m_total(total)
+		, m_allThreads(allThreads)
+		, m_begin(ReadPerfCountersOf(allThreads))
+	{
+	}
+
+	~PerfCounterScope()
+	{
+		m_total.AddDifference(ReadPerfCountersOf(m_allThreads), m_begin);
+	}
+
+	PerfCounterScope(const PerfCounterScope&) = delete;
+	PerfCounterScope& operator=(const PerfCounterScope&) = delete;
+
+	PerfCounterValues& m_total;
+	bool m_allThreads;
+	PerfCounterValues m_begin;
+};
+
+// Prints what the hardware counters counted, from when it is made to when it goes out of scope
+struct PerfCounterReport
+{
+	PerfCounterReport(const std::string& label, bool allThreads)
+		: m_label(label)
+		, m_allThreads(allThreads)
+		, m_begin(ReadPerfCountersOf(allThreads))
+	{
+	}
+
+	~PerfCounterReport()
+	{
+		PerfCounterValues counted;
+		counted.AddDifference(ReadPerfCountersOf(m_allThreads), m_begin);
+		PrintPerfCounters(m_label, counted);
+	}
+
+	PerfCounterReport(const PerfCounterReport&) = delete;
+	PerfCounterReport& operator=(const PerfCounterReport&) = delete;
+
+	std::string m_label;
+	bool m_allThreads;
+	PerfCounterValues m_begin;
+};
+
+// PERF_COUNTER_REPORT counts all OpenMP threads, and is only for outside of parallel regions.
+// PERF_COUNTER_THREAD_REPORT counts the calling thread, for work that stays on one thread.
+#if PERF_COUNTERS()
+#define PERF_COUNTER_REPORT(label) PerfCounterReport perfCounterReport(label, true)
+#define PERF_COUNTER_THREAD_REPORT(label) PerfCounterReport perfCounterReport(label, false)
+#define PERF_COUNTER_SCOPE(total, allThreads) PerfCounterScope perfCounterScope(total, allThreads)
+#else
+#define PERF_COUNTER_REPORT(label)
+#define PERF_COUNTER_THREAD_REPORT(label)
+#define PERF_COUNTER_SCOPE(total, allThreads)
+#endif
 
 struct ImageData
 {
@@ -24,6 +185,14 @@ struct ImageData
 	std::vector<float> pixels;
 };
 
+// The target images of SlicedOptimalTransport never change, so they stay as uint8, at a quarter the size of ImageData.
+struct ImageDataU8
+{
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> pixels;
+};
+
 inline float Lerp(float A, float B, float t)
 {
 	return A * (1.0f - t) + B * t;
@@ -40,273 +209,2873 @@ std::mt19937 GetRNG(int index)
 	return ret;
 }
 
+// Converts uint8 values to float, 8 at a time with SIMD.
+// Large images are split into ranges that are converted in parallel.
+void ConvertU8ToFloat(float* dest, const unsigned char* src, size_t count)
+{
+	static const size_t c_rangeSize = 64 * 1024;
+	const int numRanges = int((count + c_rangeSize - 1) / c_rangeSize);
+
+	#pragma omp parallel for
+	for (int rangeIndex = 0; rangeIndex < numRanges; ++rangeIndex)
+	{
+		const size_t begin = size_t(rangeIndex) * c_rangeSize;
+		const size_t end = std::min(begin + c_rangeSize, count);
+
+		size_t i = begin;
+		for (; i + 8 <= end; i += 8)
+		{
+			__m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&src[i]));
+			_mm256_storeu_ps(&dest[i], _mm256_cvtepi32_ps(values));
+		}
+		for (; i < end; ++i)
+			dest[i] = float(src[i]);
+	}
+}
+
+// Converts float values to uint8, 8 at a time with SIMD. Values are clamped to 0 to 255 and truncated.
+void ConvertFloatToU8(unsigned char* dest, const float* src, size_t count)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 maxValue = _mm256_set1_ps(255.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 values = _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(&src[i]), maxValue), zero);
+		__m256i integers = _mm256_cvttps_epi32(values);
+		__m128i shorts = _mm_packs_epi32(_mm256_castsi256_si128(integers), _mm256_extracti128_si256(integers, 1));
+		_mm_storel_epi64((__m128i*)&dest[i], _mm_packus_epi16(shorts, shorts));
+	}
+	for (; i < count; ++i)
+		dest[i] = (unsigned char)std::max(std::min(src[i], 255.0f), 0.0f);
+}
+
+// Loads .pfm files as they are, .qoi files with the QOI reader, and everything else with stb_image.
 bool LoadImageAsFloat(ImageData& imageData, const char* fileName)
 {
+	if (HasExtension(fileName, "pfm"))
+		return ReadPFM(fileName, imageData.width, imageData.height, imageData.pixels);
+
+	if (HasExtension(fileName, "qoi"))
+	{
+		std::vector<unsigned char> pixelsU8;
+		if (!ReadQOI(fileName, imageData.width, imageData.height, pixelsU8))
+			return false;
+		imageData.pixels.resize(pixelsU8.size());
+		ConvertU8ToFloat(imageData.pixels.data(), pixelsU8.data(), pixelsU8.size());
+		return true;
+	}
+
 	int c;
 	stbi_uc* pixelsU8 = stbi_load(fileName, &imageData.width, &imageData.height, &c, 3);
 	if (!pixelsU8)
 		return false;
 
 	imageData.pixels.resize(imageData.width * imageData.height * 3);
-
-	for (size_t i = 0; i < imageData.width * imageData.height * 3; ++i)
-		imageData.pixels[i] = float(pixelsU8[i]);
+	ConvertU8ToFloat(imageData.pixels.data(), pixelsU8, imageData.pixels.size());
 
 	stbi_image_free(pixelsU8);
 	return true;
 }
 
-bool SaveFloatImage(const ImageData& imageData, const char* fileName)
+// Reads the same formats as LoadImageAsFloat. PFM values are clamped to 0 to 255, like SaveFloatImage does.
+bool LoadImageAsU8(ImageDataU8& imageData, const char* fileName)
 {
-	std::vector<unsigned char> pixels(imageData.width * imageData.height * 3);
-	for (size_t index = 0; index < pixels.size(); ++index)
-		pixels[index] = (unsigned char)std::max(std::min(imageData.pixels[index], 255.0f), 0.0f);
+	if (HasExtension(fileName, "qoi"))
+		return ReadQOI(fileName, imageData.width, imageData.height, imageData.pixels);
 
-	return stbi_write_png(fileName, imageData.width, imageData.height, 3, pixels.data(), 0) == 1;
-}
+	if (HasExtension(fileName, "pfm"))
+	{
+		std::vector<float> pixelsFloat;
+		if (!ReadPFM(fileName, imageData.width, imageData.height, pixelsFloat))
+			return false;
+		imageData.pixels.resize(pixelsFloat.size());
+		for (size_t index = 0; index < pixelsFloat.size(); ++index)
+			imageData.pixels[index] = (unsigned char)std::max(std::min(pixelsFloat[index], 255.0f), 0.0f);
+		return true;
+	}
 
-void SlicedOptimalTransport(const ImageData& srcImage, const ImageData& targetImage, std::vector<float>& results, const char* outputFileNameCSV)
-{
-	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	int c;
+	stbi_uc* pixelsU8 = stbi_load(fileName, &imageData.width, &imageData.height, &c, 3);
+	if (!pixelsU8)
+		return false;
 
-	printf("==================================\nCalculating Optimal Transport - %s\n==================================\n", outputFileNameCSV);
+	imageData.pixels.assign(pixelsU8, pixelsU8 + imageData.width * imageData.height * 3);
 
-	FILE* file = nullptr;
-	fopen_s(&file, outputFileNameCSV, "wb");
-	fprintf(file, "\"Iteration\",\"Avg. Movement\"\n");
+	stbi_image_free(pixelsU8);
+	return true;
+}
 
-	const uint32_t c_numPixels = srcImage.width * srcImage.height;
+// An image to load with LoadImages. Exactly one of floatImage and u8Image should be set.
+struct ImageLoadJob
+{
+	const char* fileName = nullptr;
+	ImageData* floatImage = nullptr;
+	ImageDataU8* u8Image = nullptr;
+};
 
-	// start the results at the starting point - the source image
-	results = srcImage.pixels;
-	std::vector<float>& current = results; // current is an alias of results, to make the code make more sense
+// Loads the images in parallel, one per thread, since PNG decoding is single threaded.
+// Reports every image that could not be loaded and returns false if there were any.
+bool LoadImages(const std::vector<ImageLoadJob>& jobs)
+{
+	std::vector<char> loaded(jobs.size(), 0);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int jobIndex = 0; jobIndex < (int)jobs.size(); ++jobIndex)
+	{
+		TRACE_SCOPE("Load Image");
+		const ImageLoadJob& job = jobs[jobIndex];
+		loaded[jobIndex] = job.floatImage
+			? LoadImageAsFloat(*job.floatImage, job.fileName)
+			: LoadImageAsU8(*job.u8Image, job.fileName);
+	}
 
-	// Per batch data
-	// Each batch has it's own data so the batches can be parallelized
-	struct BatchData
+	bool ret = true;
+	for (size_t jobIndex = 0; jobIndex < jobs.size(); ++jobIndex)
 	{
-		BatchData(uint32_t numPixels)
+		if (!loaded[jobIndex])
 		{
-			currentSorted.resize(numPixels);
-			targetSorted.resize(numPixels);
-			for (uint32_t i = 0; i < numPixels; ++i)
-			{
-				currentSorted[i] = i;
-				targetSorted[i] = i;
-			}
+			printf("could not load %s\n", jobs[jobIndex].fileName);
+			ret = false;
+		}
+	}
+	return ret;
+}
 
-			currentProjections.resize(numPixels);
-			targetProjections.resize(numPixels);
+// An image to be written. The format comes from the file extension: .qoi, .ppm, .pfm, or PNG for anything else.
+// PFM writes floatPixels, the other formats write the uint8 pixels.
+struct ImageWriteJob
+{
+	std::string fileName;
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> pixels;
+	std::vector<float> floatPixels;
+	PNGWriteOptions options;
+};
 
-			batchDirections.resize(numPixels * 3);
-		}
+bool WriteImage(const ImageWriteJob& job)
+{
+	TRACE_SCOPE("Write Image");
+	const char* fileName = job.fileName.c_str();
+	if (HasExtension(fileName, "pfm"))
+		return WritePFM(fileName, job.width, job.height, job.floatPixels.data());
+	if (HasExtension(fileName, "qoi"))
+		return WriteQOI(fileName, job.width, job.height, job.pixels.data());
+	if (HasExtension(fileName, "ppm"))
+		return WritePPM(fileName, job.width, job.height, job.pixels.data());
+	return WritePNGParallel(fileName, job.width, job.height, 3, job.pixels.data(), job.options);
+}
 
-		std::vector<uint32_t> currentSorted;
-		std::vector<uint32_t> targetSorted;
+// Encodes and writes images on worker threads, so that PNG compression overlaps with computation.
+// The queue is bounded. Submit blocks while it is full, which limits how much memory waiting images use.
+struct AsyncImageWriter
+{
+	typedef ImageWriteJob Job;
 
-		std::vector<float> currentProjections;
-		std::vector<float> targetProjections;
+	AsyncImageWriter(int numThreads = c_numWriterThreads, size_t maxQueuedJobs = c_maxQueuedWrites)
+		: m_maxQueuedJobs(std::max<size_t>(maxQueuedJobs, 1))
+	{
+		for (int i = 0; i < std::max(numThreads, 1); ++i)
+			m_threads.emplace_back([this] () { WorkerThread(); });
+	}
 
-		std::vector<float> batchDirections;
-	};
-	std::vector<BatchData> allBatchData(c_batchSize, BatchData(c_numPixels));
+	AsyncImageWriter(const AsyncImageWriter&) = delete;
+	AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
 
-	// For each iteration
-	for (int iteration = 0; iteration < c_numIterations; ++iteration)
+	~AsyncImageWriter()
 	{
-		// Do the batches in parallel
-		#pragma omp parallel for
-		for (int batchIndex = 0; batchIndex < c_batchSize; ++batchIndex)
+		Flush();
 		{
-			BatchData& batchData = allBatchData[batchIndex];
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_jobAvailable.notify_all();
+		for (std::thread& thread : m_threads)
+			thread.join();
+	}
+
+	void Submit(Job&& job)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_spaceAvailable.wait(lock, [this] () { return m_queue.size() < m_maxQueuedJobs; });
+		m_queue.push_back(std::move(job));
+		m_jobAvailable.notify_one();
+	}
+
+	// Waits for every submitted image to be written.
+	// Returns false if any of them failed since the last flush.
+	bool Flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_allDone.wait(lock, [this] () { return m_queue.empty() && m_numActiveJobs == 0; });
+		bool ret = (m_numFailures == 0);
+		m_numFailures = 0;
+		return ret;
+	}
 
-			std::mt19937 rng = GetRNG(iteration * c_batchSize + batchIndex);
-			std::normal_distribution<float> normalDist(0.0f, 1.0f);
+private:
+	void WorkerThread()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_jobAvailable.wait(lock, [this] () { return m_stopping || !m_queue.empty(); });
+			if (m_queue.empty())
+				return;
 
-			// Make a uniform random unit vector by generating 3 normal distributed values and normalizing the result.
-			float direction[3];
-			direction[0] = normalDist(rng);
-			direction[1] = normalDist(rng);
-			direction[2] = normalDist(rng);
-			float length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
-			direction[0] /= length;
-			direction[1] /= length;
-			direction[2] /= length;
+			Job job = std::move(m_queue.front());
+			m_queue.pop_front();
+			m_numActiveJobs++;
+			m_spaceAvailable.notify_one();
 
-			// project current and target
-			for (size_t i = 0; i < c_numPixels; ++i)
+			// The writer threads already run alongside each other and the solver, so each image is written on one thread.
+			// That also means this thread's counters count all of the work of writing it.
+			lock.unlock();
+			job.options.numThreads = 1;
+			bool success = false;
 			{
-				batchData.currentProjections[i] =
-					direction[0] * current[i * 3 + 0] +
-					direction[1] * current[i * 3 + 1] +
-					direction[2] * current[i * 3 + 2];
-
-				batchData.targetProjections[i] =
-					direction[0] * targetImage.pixels[i * 3 + 0] +
-					direction[1] * targetImage.pixels[i * 3 + 1] +
-					direction[2] * targetImage.pixels[i * 3 + 2];
+				PERF_COUNTER_THREAD_REPORT("Save " + job.fileName + " on a writer thread");
+				success = WriteImage(job);
 			}
+			if (!success)
+				printf("could not write %s\n", job.fileName.c_str());
+			job = Job();
+			lock.lock();
 
-			// sort current and target
-			std::sort(batchData.currentSorted.begin(), batchData.currentSorted.end(),
-				[&] (uint32_t a, uint32_t b)
-				{
-					return batchData.currentProjections[a] < batchData.currentProjections[b];
-				}
-			);
+			m_numActiveJobs--;
+			if (!success)
+				m_numFailures++;
+			if (m_queue.empty() && m_numActiveJobs == 0)
+				m_allDone.notify_all();
+		}
+	}
 
-			std::sort(batchData.targetSorted.begin(), batchData.targetSorted.end(),
-				[&](uint32_t a, uint32_t b)
-				{
-					return batchData.targetProjections[a] < batchData.targetProjections[b];
-				}
-			);
+	const size_t m_maxQueuedJobs;
+	std::vector<std::thread> m_threads;
 
-			// update batchDirections
-			for (size_t i = 0; i < c_numPixels; ++i)
-			{
-				float projDiff = batchData.targetProjections[batchData.targetSorted[i]] - batchData.currentProjections[batchData.currentSorted[i]];
+	std::mutex m_mutex;
+	std::condition_variable m_jobAvailable;
+	std::condition_variable m_spaceAvailable;
+	std::condition_variable m_allDone;
+	std::deque<Job> m_queue;
+	int m_numActiveJobs = 0;
+	int m_numFailures = 0;
+	bool m_stopping = false;
+};
 
-				batchData.batchDirections[batchData.currentSorted[i] * 3 + 0] = direction[0] * projDiff;
-				batchData.batchDirections[batchData.currentSorted[i] * 3 + 1] = direction[1] * projDiff;
-				batchData.batchDirections[batchData.currentSorted[i] * 3 + 2] = direction[2] * projDiff;
-			}
-		}
+// Makes a job to write an image, with room for its pixels. PFM files keep the float values, everything else is uint8.
+ImageWriteJob MakeImageWriteJob(const char* fileName, int width, int height, const PNGWriteOptions& options = PNGWriteOptions())
+{
+	ImageWriteJob job;
+	job.fileName = fileName;
+	job.width = width;
+	job.height = height;
+	job.options = options;
+
+	const size_t numValues = size_t(width) * size_t(height) * 3;
+	if (HasExtension(fileName, "pfm"))
+		job.floatPixels.resize(numValues);
+	else
+		job.pixels.resize(numValues);
+	return job;
+}
+
+// Stores float values into a job's pixels, starting at valueIndex. uint8 pixels are clamped and truncated.
+void StoreImageValues(ImageWriteJob& job, size_t valueIndex, const float* values, size_t count)
+{
+	if (!job.floatPixels.empty())
+		memcpy(&job.floatPixels[valueIndex], values, count * sizeof(float));
+	else
+		ConvertFloatToU8(&job.pixels[valueIndex], values, count);
+}
+
+// Writes the job now, or gives it to the writer if there is one
+bool SubmitImage(ImageWriteJob&& job, AsyncImageWriter* writer)
+{
+	if (!writer)
+	{
+		PERF_COUNTER_REPORT("Save " + job.fileName);
+		if (WriteImage(job))
+			return true;
+		printf("could not write %s\n", job.fileName.c_str());
+		return false;
+	}
+
+	writer->Submit(std::move(job));
+	return true;
+}
+
+// Writes an image a band of rows at a time, for the formats which can be written from top to bottom: PNG, QOI and PPM.
+// The pixels are 3 channel uint8.
+struct ImageStreamWriter
+{
+	static bool CanStream(const char* fileName)
+	{
+		return !HasExtension(fileName, "pfm");
+	}
 
-		// average all batch directions into batchDirections[0]
+	bool Open(const char* fileName, int width, int height, const PNGWriteOptions& options = PNGWriteOptions())
+	{
+		m_width = width;
+		m_isQOI = HasExtension(fileName, "qoi");
+		m_isPPM = HasExtension(fileName, "ppm");
+		if (m_isQOI)
+			return m_qoi.Open(fileName, width, height);
+		if (m_isPPM)
 		{
-			for (int batchIndex = 1; batchIndex < c_batchSize; ++batchIndex)
-			{
-				float alpha = 1.0f / float(batchIndex + 1);
-				for (size_t i = 0; i < c_numPixels * 3; ++i)
-					allBatchData[0].batchDirections[i] = Lerp(allBatchData[0].batchDirections[i], allBatchData[batchIndex].batchDirections[i], alpha);
-			}
+			fopen_s(&m_ppm, fileName, "wb");
+			return m_ppm && fprintf(m_ppm, "P6\n%i %i\n255\n", width, height) > 0;
 		}
+		return m_png.Open(fileName, width, height, 3, options);
+	}
 
-		// update current
-		float totalDistance = 0.0f;
-		for (size_t i = 0; i < c_numPixels; ++i)
+	bool WriteRows(const unsigned char* rows, int numRows)
+	{
+		const size_t numPixels = size_t(m_width) * size_t(numRows);
+		if (m_isQOI)
+			return m_qoi.WritePixels(rows, numPixels);
+		if (m_isPPM)
+			return fwrite(rows, 3, numPixels, m_ppm) == numPixels;
+		return m_png.WriteRows(rows, numRows);
+	}
+
+	bool Close()
+	{
+		if (m_isQOI)
+			return m_qoi.Close();
+		if (m_isPPM)
 		{
-			float adjust[3] = {
-				allBatchData[0].batchDirections[i * 3 + 0],
-				allBatchData[0].batchDirections[i * 3 + 1],
-				allBatchData[0].batchDirections[i * 3 + 2]
-			};
+			bool ret = m_ppm && fclose(m_ppm) == 0;
+			m_ppm = nullptr;
+			return ret;
+		}
+		return m_png.Close();
+	}
 
-			current[i * 3 + 0] += adjust[0];
-			current[i * 3 + 1] += adjust[1];
-			current[i * 3 + 2] += adjust[2];
+	~ImageStreamWriter()
+	{
+		if (m_ppm)
+			fclose(m_ppm);
+	}
 
-			totalDistance += std::sqrt(adjust[0] * adjust[0] + adjust[1] * adjust[1] + adjust[2] * adjust[2]);
-		}
+	int m_width = 0;
+	bool m_isQOI = false;
+	bool m_isPPM = false;
+	PNGStreamWriter m_png;
+	QOIStreamWriter m_qoi;
+	FILE* m_ppm = nullptr;
+};
+
+// Writes the image, in the format given by the file extension.
+// PFM keeps the float values. The other formats are quantized to uint8.
+// If a writer is given, the image is queued to be written by it and only a full queue makes this wait.
+bool SaveFloatImage(const ImageData& imageData, const char* fileName, AsyncImageWriter* writer = nullptr, const PNGWriteOptions& options = PNGWriteOptions())
+{
+	ImageWriteJob job = MakeImageWriteJob(fileName, imageData.width, imageData.height, options);
+	StoreImageValues(job, 0, imageData.pixels.data(), imageData.pixels.size());
+	return SubmitImage(std::move(job), writer);
+}
+
+// The storage types the SOT working buffers can use. The math is always done in fp32.
+// The reduced precision types halve the memory and bandwidth of the projection and direction buffers.
+enum class SOTStorage
+{
+	Float32,
+	Float16,
+	BFloat16,
+	FixedPoint   // 32 bit fixed point projections sorted with a radix sort, and 16.16 fixed point directions
+};
+
+struct Half
+{
+	uint16_t bits;
+};
+
+struct BFloat16
+{
+	uint16_t bits;
+};
+
+inline size_t SOTStorageBytes(SOTStorage storage)
+{
+	return (storage == SOTStorage::Float32 || storage == SOTStorage::FixedPoint) ? sizeof(uint32_t) : sizeof(uint16_t);
+}
 
-		printf("[%i] %f\n", iteration, totalDistance / float(c_numPixels));
-		fprintf(file, "\"%i\",\"%f\"\n", iteration, totalDistance / float(c_numPixels));
+inline const char* SOTStorageName(SOTStorage storage)
+{
+	switch (storage)
+	{
+		case SOTStorage::Float32: return "fp32";
+		case SOTStorage::Float16: return "fp16";
+		case SOTStorage::BFloat16: return "bf16";
+		case SOTStorage::FixedPoint: return "fixed point";
 	}
+	return "unknown";
+}
 
-	fclose(file);
+// Scalar conversions between fp32 and the storage types
+inline float ToFloat(float value)
+{
+	return value;
+}
 
-	float elpasedSeconds = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::high_resolution_clock::now() - start).count();
-	printf("\n%0.2f seconds\n\n", elpasedSeconds);	
+inline float ToFloat(Half value)
+{
+	return _cvtsh_ss(value.bits);
+}
+
+inline float ToFloat(BFloat16 value)
+{
+	uint32_t bits = uint32_t(value.bits) << 16;
+	float ret;
+	memcpy(&ret, &bits, sizeof(ret));
+	return ret;
 }
 
-void InterpolateColorHistogram1D(const ImageData& srcImage, const std::vector<float>& target, float weight, const char* outputFileName)
+inline void FromFloat(float& dest, float value)
 {
-	// 1D barycentric coordinates. They add up to 1.0.
-	float u = 1.0f - weight;
-	float v = weight;
+	dest = value;
+}
 
-	// Do interpolation
-	ImageData output = srcImage;
-	for (size_t valueIndex = 0; valueIndex < output.width * output.height * 3; ++valueIndex)
-		output.pixels[valueIndex] = srcImage.pixels[valueIndex] * u + target[valueIndex] * v;
+inline void FromFloat(Half& dest, float value)
+{
+	dest.bits = _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+}
 
-	// Save output image
-	SaveFloatImage(output, outputFileName);
+inline void FromFloat(BFloat16& dest, float value)
+{
+	// round to nearest even
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bits += 0x7FFF + ((bits >> 16) & 1);
+	dest.bits = uint16_t(bits >> 16);
 }
 
-void InterpolateColorHistogram2D(const ImageData& srcImage, const std::vector<float>& target1, float weight1, const std::vector<float>& target2, float weight2, const char* outputFileName)
+// Converts and stores count (<= 8) floats. A full group of 8 uses F16C / AVX2.
+inline void StoreFloats(float* dest, const float* src, size_t count)
 {
-	// 2D barycentric coordinates. They add up to 1.0.
-	float u = 1.0f - (weight1 + weight2);
-	float v = weight1;
-	float w = weight2;
+	memcpy(dest, src, sizeof(float) * count);
+}
 
-	// Do interpolation
-	ImageData output = srcImage;
-	for (size_t valueIndex = 0; valueIndex < output.width * output.height * 3; ++valueIndex)
-		output.pixels[valueIndex] = srcImage.pixels[valueIndex] * u + target1[valueIndex] * v + target2[valueIndex] * w;
+inline void StoreFloats(Half* dest, const float* src, size_t count)
+{
+	if (count == 8)
+	{
+		_mm_storeu_si128((__m128i*)dest, _mm256_cvtps_ph(_mm256_loadu_ps(src), _MM_FROUND_TO_NEAREST_INT));
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		FromFloat(dest[i], src[i]);
+}
 
-	// Save output image
-	SaveFloatImage(output, outputFileName);
+inline void StoreFloats(BFloat16* dest, const float* src, size_t count)
+{
+	if (count == 8)
+	{
+		// round to nearest even, then pack the high 16 bits of each value
+		__m256i bits = _mm256_castps_si256(_mm256_loadu_ps(src));
+		__m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+		bits = _mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF)));
+		bits = _mm256_srli_epi32(bits, 16);
+		__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1));
+		_mm_storeu_si128((__m128i*)dest, packed);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		FromFloat(dest[i], src[i]);
 }
 
-int main(int argc, char** argv)
+// Loads and converts count (<= 8) values to floats. A full group of 8 uses F16C / AVX2.
+inline void LoadFloats(float* dest, const float* src, size_t count)
 {
-	_mkdir("out");
+	memcpy(dest, src, sizeof(float) * count);
+}
 
-	// Load the images
-	ImageData srcImage;
-	if (!LoadImageAsFloat(srcImage, "images/florida.png"))
+inline void LoadFloats(float* dest, const Half* src, size_t count)
+{
+	if (count == 8)
 	{
-		printf("could not load images/florida.png");
-		return 1;
+		_mm256_storeu_ps(dest, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)src)));
+		return;
 	}
+	for (size_t i = 0; i < count; ++i)
+		dest[i] = ToFloat(src[i]);
+}
 
-	ImageData imageDunes;
-	if (!LoadImageAsFloat(imageDunes, "images/dunes.png"))
+inline void LoadFloats(float* dest, const BFloat16* src, size_t count)
+{
+	if (count == 8)
 	{
-		printf("could not load images/dunes.png");
-		return 1;
+		__m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)src));
+		_mm256_storeu_ps(dest, _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+		return;
 	}
+	for (size_t i = 0; i < count; ++i)
+		dest[i] = ToFloat(src[i]);
+}
+
+// Fixed point, for SOTStorage::FixedPoint.
+// Colors are quantized to int16 with c_fixedColorBits fractional bits, and directions to int16 with c_fixedDirectionBits.
+// Projections are then int32 dot products, with the sign bit flipped so they can be radix sorted as uint32 keys.
+// Directions are stored as 16.16 fixed point.
+static const int c_fixedColorBits = 6;
+static const int c_fixedDirectionBits = 14;
+static const int c_fixedProjectionBits = c_fixedColorBits + c_fixedDirectionBits;
+static const int c_fixedDisplacementBits = 16;
 
-	ImageData imageTurtle;
-	if (!LoadImageAsFloat(imageTurtle, "images/turtle.png"))
+struct Fixed
+{
+	int32_t value;
+};
+
+inline void LoadFloats(float* dest, const Fixed* src, size_t count)
+{
+	const float scale = 1.0f / float(1 << c_fixedDisplacementBits);
+	if (count == 8)
 	{
-		printf("could not load images/turtle.png");
-		return 1;
+		__m256 values = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)src));
+		_mm256_storeu_ps(dest, _mm256_mul_ps(values, _mm256_set1_ps(scale)));
+		return;
 	}
+	for (size_t i = 0; i < count; ++i)
+		dest[i] = float(src[i].value) * scale;
+}
+
+// Quantizes RGB uint8 colors to RGBx int16 fixed point, 4 pixels at a time.
+// A shuffle spreads the 12 bytes of 4 pixels out to RGBx, and they are widened to int16 and shifted into place.
+inline void QuantizeColorsFixed(int16_t* dest, const unsigned char* src, uint32_t numPixels)
+{
+	const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
 
-	ImageData imageBigCat;
-	if (!LoadImageAsFloat(imageBigCat, "images/bigcat.png"))
+	// The 16 byte load reads past the 4 pixels, so the last few pixels of the image are done one at a time
+	size_t i = 0;
+	for (; i + 6 <= numPixels; i += 4)
 	{
-		printf("could not load images/bigcat.png");
-		return 1;
+		__m128i colors = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&src[i * 3]), spread);
+		_mm256_storeu_si256((__m256i*)&dest[i * 4], _mm256_slli_epi16(_mm256_cvtepu8_epi16(colors), c_fixedColorBits));
+	}
+	for (; i < numPixels; ++i)
+	{
+		dest[i * 4 + 0] = int16_t(src[i * 3 + 0]) << c_fixedColorBits;
+		dest[i * 4 + 1] = int16_t(src[i * 3 + 1]) << c_fixedColorBits;
+		dest[i * 4 + 2] = int16_t(src[i * 3 + 2]) << c_fixedColorBits;
+		dest[i * 4 + 3] = 0;
 	}
+}
 
-	// Calculate optimal transport from the source image to the other images
-	std::vector<float> OTDunes;
-	SlicedOptimalTransport(srcImage, imageDunes, OTDunes, "out/dunes.csv");
+// Quantizes RGB float colors to RGBx int16 fixed point. The 4th channel is zero, so a pixel is 8 bytes and SIMD friendly.
+// 8 pixels at a time: the 24 floats are permuted into 4 registers of 2 RGBx pixels, then scaled, rounded, clamped,
+// converted to int32 and packed to int16, with the same results as the scalar loop.
+inline void QuantizeColorsFixed(int16_t* dest, const float* src, uint32_t numPixels)
+{
+	const float scale = float(1 << c_fixedColorBits);
+
+	// std::round rounds halves away from zero. Adding just under a half, with the sign of the value, and truncating does the same.
+	const __m256 scale8 = _mm256_set1_ps(scale);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 almostHalf = _mm256_set1_ps(0.49999997f);
+	const __m256 minValue = _mm256_set1_ps(-32768.0f);
+	const __m256 maxValue = _mm256_set1_ps(32767.0f);
+	auto ToFixed = [&] (__m256 values) -> __m256i
+	{
+		values = _mm256_mul_ps(values, scale8);
+		values = _mm256_add_ps(values, _mm256_or_ps(_mm256_and_ps(values, signMask), almostHalf));
+		values = _mm256_max_ps(_mm256_min_ps(values, maxValue), minValue);
+		return _mm256_cvttps_epi32(values);
+	};
 
-	std::vector<float> OTTurtle;
-	SlicedOptimalTransport(srcImage, imageTurtle, OTTurtle, "out/turtle.csv");
+	// Which of the 3 input registers, and which lane of it, each RGBx lane comes from. The x lanes are zeroed by the blend.
+	const __m256i pixels01 = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i pixels23From0 = _mm256_setr_epi32(6, 7, 0, 0, 0, 0, 0, 0);
+	const __m256i pixels23From1 = _mm256_setr_epi32(0, 0, 0, 0, 1, 2, 3, 0);
+	const __m256i pixels45From1 = _mm256_setr_epi32(4, 5, 6, 0, 7, 0, 0, 0);
+	const __m256i pixels45From2 = _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 1, 0);
+	const __m256i pixels67 = _mm256_setr_epi32(2, 3, 4, 0, 5, 6, 7, 0);
+	const __m256 zero = _mm256_setzero_ps();
 
-	std::vector<float> OTBigCat;
-	SlicedOptimalTransport(srcImage, imageBigCat, OTBigCat, "out/bigcat.csv");
+	size_t i = 0;
+	for (; i + 8 <= numPixels; i += 8)
+	{
+		const __m256 in0 = _mm256_loadu_ps(&src[i * 3 + 0]);
+		const __m256 in1 = _mm256_loadu_ps(&src[i * 3 + 8]);
+		const __m256 in2 = _mm256_loadu_ps(&src[i * 3 + 16]);
 
-	// Make results
-	InterpolateColorHistogram1D(srcImage, OTDunes, 1.0f, "out/florida-dunes.png");
-	InterpolateColorHistogram1D(srcImage, OTTurtle, 1.0f, "out/florida-turtle.png");
-	InterpolateColorHistogram1D(srcImage, OTBigCat, 1.0f, "out/florida-bigcat.png");
+		__m256 rgbx01 = _mm256_permutevar8x32_ps(in0, pixels01);
+		__m256 rgbx23 = _mm256_blend_ps(_mm256_permutevar8x32_ps(in0, pixels23From0), _mm256_permutevar8x32_ps(in1, pixels23From1), 0xFC);
+		__m256 rgbx45 = _mm256_blend_ps(_mm256_permutevar8x32_ps(in1, pixels45From1), _mm256_permutevar8x32_ps(in2, pixels45From2), 0x60);
+		__m256 rgbx67 = _mm256_permutevar8x32_ps(in2, pixels67);
+		rgbx01 = _mm256_blend_ps(rgbx01, zero, 0x88);
+		rgbx23 = _mm256_blend_ps(rgbx23, zero, 0x88);
+		rgbx45 = _mm256_blend_ps(rgbx45, zero, 0x88);
+		rgbx67 = _mm256_blend_ps(rgbx67, zero, 0x88);
 
-	// Do 1d barycentric interpolation towards bigcat
-	for (int i = 0; i < 3; ++i)
+		// packs works within 128 bit lanes, which leaves the pixels in the order 0 2 1 3, so they are put back in order
+		__m256i packed0123 = _mm256_permute4x64_epi64(_mm256_packs_epi32(ToFixed(rgbx01), ToFixed(rgbx23)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i packed4567 = _mm256_permute4x64_epi64(_mm256_packs_epi32(ToFixed(rgbx45), ToFixed(rgbx67)), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*)&dest[i * 4 + 0], packed0123);
+		_mm256_storeu_si256((__m256i*)&dest[i * 4 + 16], packed4567);
+	}
+	for (; i < numPixels; ++i)
 	{
-		float alpha = float(i + 1) / 4;
-		int percent = int(alpha * 100.0f);
-		char fileName[1024];
-		sprintf_s(fileName, "out/florida-bigcat_%i.png", percent);
-		InterpolateColorHistogram1D(srcImage, OTBigCat, alpha, fileName);
+		for (size_t channel = 0; channel < 3; ++channel)
+		{
+			float value = std::round(src[i * 3 + channel] * scale);
+			dest[i * 4 + channel] = (int16_t)std::max(std::min(value, 32767.0f), -32768.0f);
+		}
+		dest[i * 4 + 3] = 0;
 	}
+}
 
-	// Do 2d barycentric interpolation towards turtle and dunes
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.0f, OTDunes, 0.33f, "out/florida-turtle_0_dunes_33.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.0f, OTDunes, 0.66f, "out/florida-turtle_0_dunes_66.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.33f, OTDunes, 0.0f, "out/florida-turtle_33_dunes_0.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.66f, OTDunes, 0.0f, "out/florida-turtle_66_dunes_0.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.33f, OTDunes, 0.66f, "out/florida-turtle_33_dunes_66.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.66f, OTDunes, 0.33f, "out/florida-turtle_66_dunes_33.png");
-	InterpolateColorHistogram2D(srcImage, OTTurtle, 0.33f, OTDunes, 0.33f, "out/florida-turtle_33_dunes_33.png");
+// Sorts keys, and values along with them, using a stable LSD radix sort of 8 bits per pass.
+// Passes where every key has the same digit are skipped. The scratch arrays need to be as large as the key and value arrays.
+inline void RadixSort(uint32_t* keys, uint32_t* values, uint32_t* scratchKeys, uint32_t* scratchValues, uint32_t count)
+{
+	// Make the histograms of all 4 digits in one pass
+	uint32_t histograms[4][256] = {};
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t key = keys[i];
+		histograms[0][key & 0xFF]++;
+		histograms[1][(key >> 8) & 0xFF]++;
+		histograms[2][(key >> 16) & 0xFF]++;
+		histograms[3][key >> 24]++;
+	}
+
+	uint32_t* srcKeys = keys;
+	uint32_t* srcValues = values;
+	uint32_t* destKeys = scratchKeys;
+	uint32_t* destValues = scratchValues;
+	for (int pass = 0; pass < 4; ++pass)
+	{
+		uint32_t* histogram = histograms[pass];
+		const int shift = pass * 8;
+
+		if (histogram[(srcKeys[0] >> shift) & 0xFF] == count)
+			continue;
+
+		// turn the counts into starting offsets
+		uint32_t offset = 0;
+		for (int digit = 0; digit < 256; ++digit)
+		{
+			uint32_t digitCount = histogram[digit];
+			histogram[digit] = offset;
+			offset += digitCount;
+		}
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t destIndex = histogram[(srcKeys[i] >> shift) & 0xFF]++;
+			destKeys[destIndex] = srcKeys[i];
+			destValues[destIndex] = srcValues[i];
+		}
+
+		std::swap(srcKeys, destKeys);
+		std::swap(srcValues, destValues);
+	}
+
+	// An odd number of passes leaves the results in the scratch arrays
+	if (srcKeys != keys)
+	{
+		memcpy(keys, srcKeys, sizeof(uint32_t) * count);
+		memcpy(values, srcValues, sizeof(uint32_t) * count);
+	}
+}
+
+// Per batch data
+// Each batch has it's own data so the batches can be parallelized.
+// These point into the memory owned by a SOTWorkspace.
+struct BatchData
+{
+	uint32_t* currentSorted = nullptr;
+	uint32_t* targetSorted = nullptr;
+
+	// These are arrays of float, Half, BFloat16 or Fixed, depending on the SOTStorage of the solve.
+	// For SOTStorage::FixedPoint the projections are uint32 radix sort keys.
+	void* currentProjections = nullptr;
+	void* targetProjections = nullptr;
+
+	void* batchDirections = nullptr;
+};
+
+// How SlicedOptimalTransport solves. The defaults are the settings at the top of this file.
+struct SOTOptions
+{
+	SOTStorage storage = SOT_STORAGE();
+	int numIterations = c_numIterations;
+	int batchSize = c_batchSize;
+	size_t memoryBudgetBytes = c_memoryBudgetBytes;
+	bool quiet = false;   // if true, nothing is printed
+};
+
+// The working memory for SlicedOptimalTransport.
+// Make one and give it to every call, so that repeated solves don't allocate or initialize new memory.
+// It is a single 64 byte aligned allocation which only grows, to fit the largest image seen.
+// If there is a memory budget, there may be fewer batch slots than the batch size, and the batches are done in waves.
+// A slot's sorted index lists then carry over between different batches, which can change how ties in the sorts are broken.
+struct SOTWorkspace
+{
+	static const size_t c_alignment = 64;
+
+	SOTWorkspace() = default;
+	SOTWorkspace(const SOTWorkspace&) = delete;
+	SOTWorkspace& operator=(const SOTWorkspace&) = delete;
+
+	~SOTWorkspace()
+	{
+		Free();
+	}
+
+	static size_t AlignUp(size_t size)
+	{
+		return (size + c_alignment - 1) & ~(c_alignment - 1);
+	}
+
+	// Makes sure there is room for the accumulator and as many of batchSize batches of numPixels as the memory budget allows.
+	void Reserve(uint32_t numPixels, SOTStorage storage, int batchSize = c_batchSize, size_t memoryBudgetBytes = c_memoryBudgetBytes)
+	{
+		const size_t storageBytes = SOTStorageBytes(storage);
+		const size_t indexBytes = AlignUp(sizeof(uint32_t) * numPixels);
+		const size_t projectionBytes = AlignUp(storageBytes * numPixels);
+		const size_t accumulatorBytes = AlignUp(sizeof(float) * numPixels * 3);
+		const size_t directionBytes = AlignUp(storageBytes * numPixels * 3);
+		const size_t batchBytes = indexBytes * 2 + projectionBytes * 2 + directionBytes;
+		const size_t fixedColorBytes = (storage == SOTStorage::FixedPoint) ? AlignUp(sizeof(int16_t) * 4 * numPixels) : 0;
+		const size_t sharedBytes = accumulatorBytes + fixedColorBytes * 2;
+
+		int slots = std::max(batchSize, 1);
+		if (memoryBudgetBytes > 0)
+		{
+			size_t budgetSlots = (memoryBudgetBytes > sharedBytes) ? (memoryBudgetBytes - sharedBytes) / batchBytes : 0;
+			if (budgetSlots < 1)
+			{
+				printf("Warning: a memory budget of %zu bytes is too small for even one batch of %u pixels. Using one batch at a time.\n", memoryBudgetBytes, numPixels);
+				budgetSlots = 1;
+			}
+			slots = (int)std::min(budgetSlots, (size_t)slots);
+		}
+
+		// std::aligned_alloc needs the size to be a multiple of the alignment
+		const size_t neededBytes = AlignUp(sharedBytes + batchBytes * slots);
+		if (neededBytes > sizeBytes)
+		{
+			Free();
+			#ifdef _WIN32
+			memory = (unsigned char*)_aligned_malloc(neededBytes, c_alignment);
+			#else
+			memory = (unsigned char*)std::aligned_alloc(c_alignment, neededBytes);
+			#endif
+			if (!memory)
+			{
+				printf("could not allocate %zu bytes of SOT working memory\n", neededBytes);
+				throw std::bad_alloc();
+			}
+			sizeBytes = neededBytes;
+		}
+		usedBytes = neededBytes;
+		numBatchSlots = slots;
+		batches.assign(numBatchSlots, BatchData());
+
+		// Carve the allocation up into the accumulator, the fixed point colors and the batches
+		accumulator = (float*)memory;
+		currentFixed = (fixedColorBytes > 0) ? (int16_t*)&memory[accumulatorBytes] : nullptr;
+		targetFixed = (fixedColorBytes > 0) ? (int16_t*)&memory[accumulatorBytes + fixedColorBytes] : nullptr;
+		for (int slotIndex = 0; slotIndex < numBatchSlots; ++slotIndex)
+		{
+			unsigned char* batchMemory = &memory[sharedBytes + batchBytes * slotIndex];
+			BatchData& batchData = batches[slotIndex];
+
+			batchData.currentSorted = (uint32_t*)batchMemory;
+			batchMemory += indexBytes;
+			batchData.targetSorted = (uint32_t*)batchMemory;
+			batchMemory += indexBytes;
+			batchData.currentProjections = batchMemory;
+			batchMemory += projectionBytes;
+			batchData.targetProjections = batchMemory;
+			batchMemory += projectionBytes;
+			batchData.batchDirections = batchMemory;
+		}
+	}
+
+	void Free()
+	{
+		#ifdef _WIN32
+		_aligned_free(memory);
+		#else
+		std::free(memory);
+		#endif
+		memory = nullptr;
+		sizeBytes = 0;
+		usedBytes = 0;
+		numBatchSlots = 0;
+		accumulator = nullptr;
+		currentFixed = nullptr;
+		targetFixed = nullptr;
+		batches.clear();
+	}
+
+	unsigned char* memory = nullptr;
+	size_t sizeBytes = 0;        // how big the allocation is
+	size_t usedBytes = 0;        // how much of it the current solve uses
+	int numBatchSlots = 0;       // how many batches can be in flight at once
+	float* accumulator = nullptr; // the average of the batch directions, 3 floats per pixel
+	int16_t* currentFixed = nullptr; // for SOTStorage::FixedPoint, the quantized current and target colors
+	int16_t* targetFixed = nullptr;
+	std::vector<BatchData> batches;
+};
+
+// Projects 8 uint8 RGB pixels onto direction.
+// Each 128 bit lane gets 4 pixels, which are widened to int32 per channel with a shuffle and converted to float.
+// Reads 4 bytes past the 8 pixels, so the caller needs to make sure those are there.
+inline __m256 ProjectColorsU8x8(const unsigned char* colors, const float direction[3])
+{
+	__m256i bytes = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&colors[0])),
+		_mm_loadu_si128((const __m128i*)&colors[12]), 1);
+
+	const __m256i shuffleR = _mm256_setr_epi8(
+		0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+		0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+	const __m256i shuffleG = _mm256_setr_epi8(
+		1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+		1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+	const __m256i shuffleB = _mm256_setr_epi8(
+		2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+		2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+
+	__m256 r = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, shuffleR));
+	__m256 g = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, shuffleG));
+	__m256 b = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, shuffleB));
+
+	__m256 projection = _mm256_mul_ps(r, _mm256_set1_ps(direction[0]));
+	projection = _mm256_add_ps(projection, _mm256_mul_ps(g, _mm256_set1_ps(direction[1])));
+	projection = _mm256_add_ps(projection, _mm256_mul_ps(b, _mm256_set1_ps(direction[2])));
+	return projection;
+}
+
+// A projection of uint8 colors onto a direction, as 3 tables of 256 values. It fits in L1 and is made once per batch.
+struct ProjectionLUT
+{
+	ProjectionLUT(const float direction[3])
+	{
+		for (int value = 0; value < 256; ++value)
+		{
+			table[0][value] = direction[0] * float(value);
+			table[1][value] = direction[1] * float(value);
+			table[2][value] = direction[2] * float(value);
+		}
+	}
+
+	float Project(const unsigned char* color) const
+	{
+		return table[0][color[0]] + table[1][color[1]] + table[2][color[2]];
+	}
+
+	float table[3][256];
+};
+
+// The stages of a SlicedOptimalTransport iteration, which STAGE_TIMING() times
+enum class SOTStage
+{
+	Directions,   // making the random directions
+	Projection,   // projecting current and target onto the directions, and quantizing current for fixed point
+	CurrentSort,
+	TargetSort,
+	Matching,     // making the batch directions from the sorted projections
+	Averaging,    // averaging the batch directions into the accumulator
+	Update,       // moving current by the accumulator
+	Count
+};
+
+inline const char* SOTStageName(SOTStage stage)
+{
+	switch (stage)
+	{
+		case SOTStage::Directions: return "Directions";
+		case SOTStage::Projection: return "Projection";
+		case SOTStage::CurrentSort: return "Current Sort";
+		case SOTStage::TargetSort: return "Target Sort";
+		case SOTStage::Matching: return "Matching";
+		case SOTStage::Averaging: return "Averaging";
+		case SOTStage::Update: return "Update";
+		case SOTStage::Count: break;
+	}
+	return "unknown";
+}
+
+// Seconds spent in each stage. Start() starts timing, and each Mark() adds the time since the last Start() or Mark() to a stage.
+// The batches add their times together, so the batch stages are the time of all threads, not wall time.
+// With TRACING(), each Mark() is also an event in the trace. With PERF_COUNTERS(), the thread's hardware counters are added up too.
+struct SOTStageTimes
+{
+	void Start()
+	{
+		#if STAGE_TIMING() || TRACING()
+		last = std::chrono::steady_clock::now();
+		#endif
+		#if PERF_COUNTERS()
+		ReadPerfCounters(lastCounters);
+		#endif
+	}
+
+	void Mark(SOTStage stage)
+	{
+		#if STAGE_TIMING() || TRACING()
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		seconds[(int)stage] += std::chrono::duration<double>(now - last).count();
+		#if TRACING()
+		TraceEvent(SOTStageName(stage), last, now);
+		#endif
+		last = now;
+		#endif
+
+		#if PERF_COUNTERS()
+		PerfCounterValues nowCounters;
+		ReadPerfCounters(nowCounters);
+		counters[(int)stage].AddDifference(nowCounters, lastCounters);
+		lastCounters = nowCounters;
+		#endif
+		(void)stage;
+	}
+
+	void Add(const SOTStageTimes& other)
+	{
+		for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+		{
+			seconds[stageIndex] += other.seconds[stageIndex];
+			counters[stageIndex].Add(other.counters[stageIndex]);
+		}
+	}
+
+	double seconds[(int)SOTStage::Count] = {};
+	std::chrono::steady_clock::time_point last;
+	PerfCounterValues counters[(int)SOTStage::Count];
+	PerfCounterValues lastCounters;
+};
+
+// Sorts a batch's projections, and matches them up to make the batch directions.
+// This is the part of SOTBatch which --replay-projections runs on captured projections.
+template <typename T>
+void SOTSortAndMatch(const BatchData& batchData, const float direction[3], uint32_t numPixels, SOTStageTimes& times)
+{
+	const T* currentProjections = (const T*)batchData.currentProjections;
+	const T* targetProjections = (const T*)batchData.targetProjections;
+	T* batchDirections = (T*)batchData.batchDirections;
+
+	// sort current and target
+	std::sort(batchData.currentSorted, batchData.currentSorted + numPixels,
+		[&] (uint32_t a, uint32_t b)
+		{
+			return ToFloat(currentProjections[a]) < ToFloat(currentProjections[b]);
+		}
+	);
+	times.Mark(SOTStage::CurrentSort);
+
+	std::sort(batchData.targetSorted, batchData.targetSorted + numPixels,
+		[&](uint32_t a, uint32_t b)
+		{
+			return ToFloat(targetProjections[a]) < ToFloat(targetProjections[b]);
+		}
+	);
+	times.Mark(SOTStage::TargetSort);
+
+	// update batchDirections
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		float projDiff = ToFloat(targetProjections[batchData.targetSorted[i]]) - ToFloat(currentProjections[batchData.currentSorted[i]]);
+
+		FromFloat(batchDirections[batchData.currentSorted[i] * 3 + 0], direction[0] * projDiff);
+		FromFloat(batchDirections[batchData.currentSorted[i] * 3 + 1], direction[1] * projDiff);
+		FromFloat(batchDirections[batchData.currentSorted[i] * 3 + 2], direction[2] * projDiff);
+	}
+	times.Mark(SOTStage::Matching);
+}
+
+// Does a single batch of an iteration: projects current and target onto the direction, sorts them,
+// and writes how far each pixel should move into the batch directions.
+template <typename T>
+void SOTBatch(const BatchData& batchData, const float direction[3], const float* current, const unsigned char* target, uint32_t numPixels, SOTStageTimes& times)
+{
+	T* currentProjections = (T*)batchData.currentProjections;
+	T* targetProjections = (T*)batchData.targetProjections;
+
+	#if TARGET_PROJECTION_LUT()
+	const ProjectionLUT targetLUT(direction);
+	#endif
+
+	// project current and target, 8 pixels at a time so the stores can be converted with SIMD
+	for (size_t i = 0; i < numPixels; i += 8)
+	{
+		const size_t count = std::min<size_t>(8, numPixels - i);
+
+		float currentProjection[8];
+		float targetProjection[8];
+		for (size_t j = 0; j < count; ++j)
+		{
+			const size_t pixelIndex = i + j;
+
+			currentProjection[j] =
+				direction[0] * current[pixelIndex * 3 + 0] +
+				direction[1] * current[pixelIndex * 3 + 1] +
+				direction[2] * current[pixelIndex * 3 + 2];
+		}
+
+		#if TARGET_PROJECTION_LUT()
+		for (size_t j = 0; j < count; ++j)
+			targetProjection[j] = targetLUT.Project(&target[(i + j) * 3]);
+		#else
+		// The SIMD load reads past the 8 pixels, so the last few pixels of the image are done one at a time
+		if (i + 10 <= numPixels)
+		{
+			_mm256_storeu_ps(targetProjection, ProjectColorsU8x8(&target[i * 3], direction));
+		}
+		else
+		{
+			for (size_t j = 0; j < count; ++j)
+			{
+				const size_t pixelIndex = i + j;
+
+				targetProjection[j] =
+					direction[0] * float(target[pixelIndex * 3 + 0]) +
+					direction[1] * float(target[pixelIndex * 3 + 1]) +
+					direction[2] * float(target[pixelIndex * 3 + 2]);
+			}
+		}
+		#endif
+
+		StoreFloats(&currentProjections[i], currentProjection, count);
+		StoreFloats(&targetProjections[i], targetProjection, count);
+	}
+	times.Mark(SOTStage::Projection);
+
+	SOTSortAndMatch<T>(batchData, direction, numPixels, times);
+}
+
+inline void QuantizeDirectionFixed(int16_t directionFixed[3], const float direction[3])
+{
+	const float directionScale = float(1 << c_fixedDirectionBits);
+	for (int channel = 0; channel < 3; ++channel)
+		directionFixed[channel] = (int16_t)std::round(direction[channel] * directionScale);
+}
+
+// Radix sorts a fixed point batch's keys, along with the pixel indices, and matches them up to make the batch directions.
+// The sorted index lists need to be the identity, and the batch directions are used as scratch memory for the sort.
+// This is the part of SOTBatchFixedPoint which --replay-projections runs on captured projections.
+inline void SOTSortAndMatchFixedPoint(const BatchData& batchData, const int16_t directionFixed[3], uint32_t numPixels, SOTStageTimes& times)
+{
+	uint32_t* currentKeys = (uint32_t*)batchData.currentProjections;
+	uint32_t* targetKeys = (uint32_t*)batchData.targetProjections;
+	Fixed* batchDirections = (Fixed*)batchData.batchDirections;
+
+	// sort current and target
+	uint32_t* scratchKeys = (uint32_t*)batchDirections;
+	uint32_t* scratchValues = scratchKeys + numPixels;
+	RadixSort(currentKeys, batchData.currentSorted, scratchKeys, scratchValues, numPixels);
+	times.Mark(SOTStage::CurrentSort);
+	RadixSort(targetKeys, batchData.targetSorted, scratchKeys, scratchValues, numPixels);
+	times.Mark(SOTStage::TargetSort);
+
+	// update batchDirections.
+	// The keys are sorted along with the indices, so the projection difference doesn't need to gather.
+	// The flipped sign bits cancel out in the difference.
+	const int c_shift = c_fixedDirectionBits + c_fixedProjectionBits - c_fixedDisplacementBits;
+	for (uint32_t i = 0; i < numPixels; ++i)
+	{
+		int64_t projDiff = int32_t(targetKeys[i] - currentKeys[i]);
+		uint32_t pixelIndex = batchData.currentSorted[i];
+
+		batchDirections[pixelIndex * 3 + 0].value = int32_t((projDiff * directionFixed[0]) >> c_shift);
+		batchDirections[pixelIndex * 3 + 1].value = int32_t((projDiff * directionFixed[1]) >> c_shift);
+		batchDirections[pixelIndex * 3 + 2].value = int32_t((projDiff * directionFixed[2]) >> c_shift);
+	}
+	times.Mark(SOTStage::Matching);
+}
+
+// The SOTStorage::FixedPoint version of SOTBatch.
+// The current and target colors have already been quantized by QuantizeColorsFixed.
+// Projections are sort keys made with integer SIMD, and the batch directions are used as radix sort scratch memory.
+inline void SOTBatchFixedPoint(const BatchData& batchData, const float direction[3], const int16_t* currentFixed, const int16_t* targetFixed, uint32_t numPixels, SOTStageTimes& times)
+{
+	uint32_t* currentKeys = (uint32_t*)batchData.currentProjections;
+	uint32_t* targetKeys = (uint32_t*)batchData.targetProjections;
+
+	int16_t directionFixed[3];
+	QuantizeDirectionFixed(directionFixed, direction);
+
+	// project current and target, 8 pixels at a time.
+	// madd does r*dr+g*dg and b*db+0 for each pixel, and hadd adds those two together.
+	// The radix sort is stable, so the sorted index lists start as the identity each time.
+	const __m256i directionPairs = _mm256_setr_epi16(
+		directionFixed[0], directionFixed[1], directionFixed[2], 0, directionFixed[0], directionFixed[1], directionFixed[2], 0,
+		directionFixed[0], directionFixed[1], directionFixed[2], 0, directionFixed[0], directionFixed[1], directionFixed[2], 0);
+	const __m256i signBit = _mm256_set1_epi32(int(0x80000000));
+	const __m256i indexOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	auto ProjectFixed8 = [&](const int16_t* colors) -> __m256i
+	{
+		__m256i a = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)&colors[0]), directionPairs);
+		__m256i b = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)&colors[16]), directionPairs);
+		__m256i projections = _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		return _mm256_xor_si256(projections, signBit);
+	};
+
+	uint32_t i = 0;
+	for (; i + 8 <= numPixels; i += 8)
+	{
+		_mm256_storeu_si256((__m256i*)&currentKeys[i], ProjectFixed8(&currentFixed[i * 4]));
+		_mm256_storeu_si256((__m256i*)&targetKeys[i], ProjectFixed8(&targetFixed[i * 4]));
+
+		__m256i indices = _mm256_add_epi32(_mm256_set1_epi32(int(i)), indexOffsets);
+		_mm256_storeu_si256((__m256i*)&batchData.currentSorted[i], indices);
+		_mm256_storeu_si256((__m256i*)&batchData.targetSorted[i], indices);
+	}
+	for (; i < numPixels; ++i)
+	{
+		int32_t currentProjection = 0;
+		int32_t targetProjection = 0;
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			currentProjection += int32_t(currentFixed[i * 4 + channel]) * int32_t(directionFixed[channel]);
+			targetProjection += int32_t(targetFixed[i * 4 + channel]) * int32_t(directionFixed[channel]);
+		}
+		currentKeys[i] = uint32_t(currentProjection) ^ 0x80000000;
+		targetKeys[i] = uint32_t(targetProjection) ^ 0x80000000;
+		batchData.currentSorted[i] = i;
+		batchData.targetSorted[i] = i;
+	}
+	times.Mark(SOTStage::Projection);
+
+	SOTSortAndMatchFixedPoint(batchData, directionFixed, numPixels, times);
+}
+
+// Averages a batch's directions into the accumulator. batchIndex 0 initializes the accumulator.
+template <typename T>
+void SOTAccumulate(float* accumulator, const void* batchDirectionsMemory, int batchIndex, uint32_t numValues)
+{
+	const T* batchDirections = (const T*)batchDirectionsMemory;
+	float alpha = 1.0f / float(batchIndex + 1);
+	for (size_t i = 0; i < numValues; i += 8)
+	{
+		const size_t count = std::min<size_t>(8, numValues - i);
+
+		float batchDirection[8];
+		LoadFloats(batchDirection, &batchDirections[i], count);
+
+		if (batchIndex == 0)
+		{
+			memcpy(&accumulator[i], batchDirection, sizeof(float) * count);
+			continue;
+		}
+
+		for (size_t j = 0; j < count; ++j)
+			accumulator[i + j] = Lerp(accumulator[i + j], batchDirection[j], alpha);
+	}
+}
+
+// Loads the machine's bandwidth and FLOPs from the cache directory, or measures them and saves them there
+MachineRoof LoadMachineRoof()
+{
+	char fileName[1024];
+	sprintf_s(fileName, "%s/%s", c_transportCacheDir, c_machineRoofFileName);
+	_mkdir(c_transportCacheDir);
+	return GetMachineRoof(fileName);
+}
+
+// The machine's bandwidth and FLOPs, measured the first time they are needed on this machine
+const MachineRoof& MeasuredMachineRoof()
+{
+	static const MachineRoof roof = LoadMachineRoof();
+	return roof;
+}
+
+// Reports the roofline of the solver stages. The bytes and FLOPs of each stage are worked out from the image size.
+// The batch stages were timed on all threads added together, so they are divided by how many ran at once.
+// The sorts are counted as N log2 N comparisons which each read an index and gather a projection, or as the 5 passes
+// over the keys and indices of the radix sort.
+void ReportSOTRoofline(uint32_t numPixels, const SOTOptions& options, int numBatchSlots, const SOTStageTimes& times)
+{
+	const double N = double(numPixels);
+	const double S = double(SOTStorageBytes(options.storage));
+	const double batches = double(options.numIterations) * options.batchSize;
+	const double iterations = double(options.numIterations);
+	const double concurrency = double(std::max(std::min(omp_get_max_threads(), numBatchSlots), 1));
+	const bool fixedPoint = (options.storage == SOTStorage::FixedPoint);
+
+	const double projectionBytes = fixedPoint ? (N * 8 * 2 + N * 4 * 4) * batches + (N * 12 + N * 8) * iterations : (N * 12 + N * 3 + N * S * 2) * batches;
+	const double sortBytes = fixedPoint ? N * 68 * batches : N * std::log2(std::max(N, 2.0)) * (4 + S) * batches;
+	const double matchingBytes = (N * 8 + N * S * 5) * batches;
+
+	auto BatchSeconds = [&] (SOTStage stage) { return times.seconds[(int)stage] / concurrency; };
+	std::vector<RooflineStage> stages = {
+		{ "Projection", projectionBytes, fixedPoint ? 0.0 : N * 10 * batches, BatchSeconds(SOTStage::Projection) },
+		{ "Current Sort", sortBytes, 0.0, BatchSeconds(SOTStage::CurrentSort) },
+		{ "Target Sort", sortBytes, 0.0, BatchSeconds(SOTStage::TargetSort) },
+		{ "Matching", matchingBytes, fixedPoint ? 0.0 : N * 4 * batches, BatchSeconds(SOTStage::Matching) },
+		{ "Averaging", (N * S * 3 + N * 24) * batches, N * 9 * batches, times.seconds[(int)SOTStage::Averaging] },
+		{ "Update", N * 36 * iterations, N * 10 * iterations, times.seconds[(int)SOTStage::Update] },
+	};
+	PrintRoofline("Solver roofline", stages, MeasuredMachineRoof());
+}
+
+bool IsProjectionCaptureIteration(int iteration)
+{
+	for (int captureIteration : c_projectionCaptureIterations)
+	{
+		if (captureIteration == iteration)
+			return true;
+	}
+	return false;
+}
+
+// Writes the projections of a batch that has just been done to "<outputFileNameCSV>.iteration<N>.proj", in pixel order.
+// The sorts of the float types only move the indices, so their projections are still in pixel order.
+// The fixed point keys were sorted along with the pixel indices, so they are put back.
+void CaptureProjections(const char* outputFileNameCSV, int iteration, int batchIndex, SOTStorage storage, const BatchData& batchData, const float direction[3], uint32_t numPixels)
+{
+	ProjectionCapture capture;
+	capture.storage = uint32_t(storage);
+	capture.elementBytes = uint32_t(SOTStorageBytes(storage));
+	capture.numPixels = numPixels;
+	capture.iteration = uint32_t(iteration);
+	capture.batchIndex = uint32_t(batchIndex);
+	memcpy(capture.direction, direction, sizeof(capture.direction));
+
+	const size_t arrayBytes = size_t(numPixels) * capture.elementBytes;
+	capture.currentProjections.resize(arrayBytes);
+	capture.targetProjections.resize(arrayBytes);
+	if (storage == SOTStorage::FixedPoint)
+	{
+		const uint32_t* currentKeys = (const uint32_t*)batchData.currentProjections;
+		const uint32_t* targetKeys = (const uint32_t*)batchData.targetProjections;
+		uint32_t* currentProjections = (uint32_t*)capture.currentProjections.data();
+		uint32_t* targetProjections = (uint32_t*)capture.targetProjections.data();
+		for (uint32_t i = 0; i < numPixels; ++i)
+		{
+			currentProjections[batchData.currentSorted[i]] = currentKeys[i];
+			targetProjections[batchData.targetSorted[i]] = targetKeys[i];
+		}
+	}
+	else
+	{
+		memcpy(capture.currentProjections.data(), batchData.currentProjections, arrayBytes);
+		memcpy(capture.targetProjections.data(), batchData.targetProjections, arrayBytes);
+	}
+
+	char fileName[1024];
+	sprintf_s(fileName, "%s.iteration%i.proj", outputFileNameCSV, iteration);
+	if (!WriteProjectionCapture(fileName, capture))
+		printf("could not write %s\n", fileName);
+}
+
+// The most memory the process has had resident so far, measured by the OS. 0 if it can't be read.
+size_t PeakProcessMemoryBytes()
+{
+	#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+	#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		return size_t(usage.ru_maxrss) * 1024;
+	return 0;
+	#endif
+}
+
+// Moves the colors of srcImage to match the color histogram of targetImage. The progress of each iteration is written
+// to outputFileNameCSV, unless it is null.
+void SlicedOptimalTransport(const ImageData& srcImage, const ImageDataU8& targetImage, std::vector<float>& results, const char* outputFileNameCSV, SOTWorkspace& workspace, const SOTOptions& options = SOTOptions())
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	const SOTStorage storage = options.storage;
+	const int c_numIterations = options.numIterations;
+	const int c_batchSize = options.batchSize;
+
+	if (!options.quiet)
+		printf("==================================\nCalculating Optimal Transport - %s\n==================================\n", outputFileNameCSV ? outputFileNameCSV : "");
+
+	FILE* file = nullptr;
+	if (outputFileNameCSV)
+		fopen_s(&file, outputFileNameCSV, "wb");
+	if (file)
+	{
+		fprintf(file, "\"Iteration\",\"Avg. Movement\"");
+		#if STAGE_TIMING()
+		for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+			fprintf(file, ",\"%s (ms)\"", SOTStageName((SOTStage)stageIndex));
+		fprintf(file, ",\"Iteration (ms)\",\"Pixels x Iterations / s\"");
+		#endif
+		#if PERF_COUNTERS()
+		for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+		{
+			for (int counter = 0; counter < PerfCounters::Count; ++counter)
+				fprintf(file, ",\"%s %s\"", SOTStageName((SOTStage)stageIndex), PerfCounterName(counter));
+		}
+		#endif
+		fprintf(file, "\n");
+	}
+
+	const uint32_t c_numPixels = srcImage.width * srcImage.height;
+
+	// start the results at the starting point - the source image
+	results = srcImage.pixels;
+	std::vector<float>& current = results; // current is an alias of results, to make the code make more sense
+
+	// Get the batch data from the workspace.
+	// The sorted index lists start out as the identity, so that the results don't depend on previous solves.
+	// Each batch initializes it's own memory, on the thread that will use it.
+	workspace.Reserve(c_numPixels, storage, c_batchSize, options.memoryBudgetBytes);
+	BatchData* allBatchData = workspace.batches.data();
+	const int c_numBatchSlots = workspace.numBatchSlots;
+	#pragma omp parallel for
+	for (int slotIndex = 0; slotIndex < c_numBatchSlots; ++slotIndex)
+	{
+		BatchData& batchData = allBatchData[slotIndex];
+		for (uint32_t i = 0; i < c_numPixels; ++i)
+		{
+			batchData.currentSorted[i] = i;
+			batchData.targetSorted[i] = i;
+		}
+	}
+
+	// The fixed point path projects quantized colors. The target only needs to be quantized once.
+	if (storage == SOTStorage::FixedPoint)
+		QuantizeColorsFixed(workspace.targetFixed, targetImage.pixels.data(), c_numPixels);
+
+	// For each iteration
+	SOTStageTimes totalTimes;
+	double totalIterationSeconds = 0.0;
+	std::vector<SOTStageTimes> batchTimes(c_numBatchSlots); // per slot of a wave, reset at the start of each wave
+	for (int iteration = 0; iteration < c_numIterations; ++iteration)
+	{
+		std::chrono::high_resolution_clock::time_point iterationStart = std::chrono::high_resolution_clock::now();
+		SOTStageTimes iterationTimes;
+		iterationTimes.Start();
+
+		if (storage == SOTStorage::FixedPoint)
+			QuantizeColorsFixed(workspace.currentFixed, current.data(), c_numPixels);
+		iterationTimes.Mark(SOTStage::Projection);
+
+		// Do the batches in waves of as many as the memory budget allows
+		for (int waveStart = 0; waveStart < c_batchSize; waveStart += c_numBatchSlots)
+		{
+			const int waveSize = std::min(c_numBatchSlots, c_batchSize - waveStart);
+
+			// Do the batches of this wave in parallel
+			#pragma omp parallel for
+			for (int slotIndex = 0; slotIndex < waveSize; ++slotIndex)
+			{
+				const int batchIndex = waveStart + slotIndex;
+				BatchData& batchData = allBatchData[slotIndex];
+				SOTStageTimes& times = batchTimes[slotIndex];
+				times = SOTStageTimes();
+				times.Start();
+
+				std::mt19937 rng = GetRNG(iteration * c_batchSize + batchIndex);
+				std::normal_distribution<float> normalDist(0.0f, 1.0f);
+
+				// Make a uniform random unit vector by generating 3 normal distributed values and normalizing the result.
+				float direction[3];
+				direction[0] = normalDist(rng);
+				direction[1] = normalDist(rng);
+				direction[2] = normalDist(rng);
+				float length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+				direction[0] /= length;
+				direction[1] /= length;
+				direction[2] /= length;
+				times.Mark(SOTStage::Directions);
+
+				switch (storage)
+				{
+					case SOTStorage::Float32: SOTBatch<float>(batchData, direction, current.data(), targetImage.pixels.data(), c_numPixels, times); break;
+					case SOTStorage::Float16: SOTBatch<Half>(batchData, direction, current.data(), targetImage.pixels.data(), c_numPixels, times); break;
+					case SOTStorage::BFloat16: SOTBatch<BFloat16>(batchData, direction, current.data(), targetImage.pixels.data(), c_numPixels, times); break;
+					case SOTStorage::FixedPoint: SOTBatchFixedPoint(batchData, direction, workspace.currentFixed, workspace.targetFixed, c_numPixels, times); break;
+				}
+
+				#if PROJECTION_CAPTURE()
+				if (batchIndex == 0 && outputFileNameCSV && IsProjectionCaptureIteration(iteration))
+					CaptureProjections(outputFileNameCSV, iteration, batchIndex, storage, batchData, direction, c_numPixels);
+				#endif
+			}
+			for (int slotIndex = 0; slotIndex < waveSize; ++slotIndex)
+				iterationTimes.Add(batchTimes[slotIndex]);
+			iterationTimes.Start();
+
+			// average the batch directions of this wave into the accumulator
+			for (int slotIndex = 0; slotIndex < waveSize; ++slotIndex)
+			{
+				const int batchIndex = waveStart + slotIndex;
+				const void* batchDirections = allBatchData[slotIndex].batchDirections;
+				switch (storage)
+				{
+					case SOTStorage::Float32: SOTAccumulate<float>(workspace.accumulator, batchDirections, batchIndex, c_numPixels * 3); break;
+					case SOTStorage::Float16: SOTAccumulate<Half>(workspace.accumulator, batchDirections, batchIndex, c_numPixels * 3); break;
+					case SOTStorage::BFloat16: SOTAccumulate<BFloat16>(workspace.accumulator, batchDirections, batchIndex, c_numPixels * 3); break;
+					case SOTStorage::FixedPoint: SOTAccumulate<Fixed>(workspace.accumulator, batchDirections, batchIndex, c_numPixels * 3); break;
+				}
+			}
+			iterationTimes.Mark(SOTStage::Averaging);
+		}
+
+		// update current
+		float totalDistance = 0.0f;
+		for (size_t i = 0; i < c_numPixels; ++i)
+		{
+			float adjust[3] = {
+				workspace.accumulator[i * 3 + 0],
+				workspace.accumulator[i * 3 + 1],
+				workspace.accumulator[i * 3 + 2]
+			};
+
+			current[i * 3 + 0] += adjust[0];
+			current[i * 3 + 1] += adjust[1];
+			current[i * 3 + 2] += adjust[2];
+
+			totalDistance += std::sqrt(adjust[0] * adjust[0] + adjust[1] * adjust[1] + adjust[2] * adjust[2]);
+		}
+		iterationTimes.Mark(SOTStage::Update);
+
+		const double iterationSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - iterationStart).count();
+		totalTimes.Add(iterationTimes);
+		totalIterationSeconds += iterationSeconds;
+
+		if (!options.quiet)
+			printf("[%i] %f\n", iteration, totalDistance / float(c_numPixels));
+
+		if (file)
+		{
+			fprintf(file, "\"%i\",\"%f\"", iteration, totalDistance / float(c_numPixels));
+			#if STAGE_TIMING()
+			for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+				fprintf(file, ",\"%f\"", iterationTimes.seconds[stageIndex] * 1000.0);
+			fprintf(file, ",\"%f\",\"%f\"", iterationSeconds * 1000.0, double(c_numPixels) / iterationSeconds);
+			#endif
+			#if PERF_COUNTERS()
+			for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+			{
+				for (int counter = 0; counter < PerfCounters::Count; ++counter)
+					fprintf(file, ",\"%llu\"", (unsigned long long)iterationTimes.counters[stageIndex].values[counter]);
+			}
+			#endif
+			fprintf(file, "\n");
+		}
+	}
+
+	if (file)
+		fclose(file);
+	if (options.quiet)
+		return;
+
+	float elpasedSeconds = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::high_resolution_clock::now() - start).count();
+	printf("\n%0.2f seconds\n", elpasedSeconds);
+	#if STAGE_TIMING()
+	printf("%0.2f million pixels x iterations per second\n", double(c_numPixels) * c_numIterations / totalIterationSeconds / 1000000.0);
+	printf("Stage times, of all threads:");
+	for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+		printf(" %s %0.2fs", SOTStageName((SOTStage)stageIndex), totalTimes.seconds[stageIndex]);
+	printf("\n");
+	#endif
+	#if ROOFLINE_REPORT()
+	ReportSOTRoofline(c_numPixels, options, c_numBatchSlots, totalTimes);
+	#endif
+	#if PERF_COUNTERS()
+	for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+	{
+		const uint64_t* values = totalTimes.counters[stageIndex].values;
+		printf("%s: %0.3f G cycles, %0.2f IPC, %0.3f M LLC misses, %0.3f M dTLB misses\n", SOTStageName((SOTStage)stageIndex),
+			double(values[PerfCounters::Cycles]) / 1e9, double(values[PerfCounters::Instructions]) / std::max(double(values[PerfCounters::Cycles]), 1.0),
+			double(values[PerfCounters::LLCMisses]) / 1e6, double(values[PerfCounters::DTLBMisses]) / 1e6);
+	}
+	#endif
+	printf("%0.2f MB workspace (%s), %i batches at a time. %0.2f MB peak process memory.\n\n", double(workspace.usedBytes) / (1024.0 * 1024.0),
+		SOTStorageName(storage), c_numBatchSlots, double(PeakProcessMemoryBytes()) / (1024.0 * 1024.0));
+}
+
+// Reports how far results are from reference results, in 0 to 255 color units
+void ReportAccuracy(const char* label, const float* reference, const float* results, size_t count)
+{
+	double maxError = 0.0;
+	double totalError = 0.0;
+	double totalSquaredError = 0.0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		double error = std::abs(double(results[i]) - double(reference[i]));
+		maxError = std::max(maxError, error);
+		totalError += error;
+		totalSquaredError += error * error;
+	}
+
+	double meanError = totalError / double(count);
+	double mse = totalSquaredError / double(count);
+	double psnr = (mse > 0.0) ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+	printf("%s: max error %f, mean error %f, PSNR %0.2f dB\n\n", label, maxError, meanError, psnr);
+}
+
+// Solves again with fp32 storage and reports how much results, made with SOT_STORAGE(), differ from it
+void ReportStorageAccuracy(const ImageData& srcImage, const ImageDataU8& targetImage, const TransportResult& results, const char* outputFileNameCSV, SOTWorkspace& workspace)
+{
+	if (SOT_STORAGE() == SOTStorage::Float32)
+		return;
+
+	char fileName[1024];
+	sprintf_s(fileName, "%s.fp32.csv", outputFileNameCSV);
+
+	std::vector<float> reference;
+	SOTOptions options;
+	options.storage = SOTStorage::Float32;
+	SlicedOptimalTransport(srcImage, targetImage, reference, fileName, workspace, options);
+
+	char label[1024];
+	sprintf_s(label, "%s %s vs fp32", outputFileNameCSV, SOTStorageName(SOT_STORAGE()));
+	ReportAccuracy(label, reference.data(), results.data(), reference.size());
+}
+
+// Calls SlicedOptimalTransport, unless the result is already in the transport cache, in which case it is memory mapped.
+// The cache key covers the source and target pixels, and every setting that changes the result.
+void CachedSlicedOptimalTransport(const ImageData& srcImage, const ImageDataU8& targetImage, TransportResult& result, const char* outputFileNameCSV, SOTWorkspace& workspace)
+{
+	#if TRANSPORT_CACHE() && DETERMINISTIC()
+	const uint64_t settings[] = {
+		c_transportCacheVersion,
+		uint64_t(srcImage.width),
+		uint64_t(srcImage.height),
+		uint64_t(c_numIterations),
+		uint64_t(c_batchSize),
+		uint64_t(c_memoryBudgetBytes),
+		uint64_t(SOT_STORAGE()),
+		uint64_t(TARGET_PROJECTION_LUT() ? 1 : 0)
+	};
+	uint64_t key[2] = { 0, 0 };
+	HashBytes(key, settings, sizeof(settings));
+	HashBytes(key, srcImage.pixels.data(), srcImage.pixels.size() * sizeof(float));
+	HashBytes(key, targetImage.pixels.data(), targetImage.pixels.size());
+
+	char cacheFileName[1024];
+	TransportCacheFileName(cacheFileName, sizeof(cacheFileName), c_transportCacheDir, key);
+	bool loaded;
+	{
+		TRACE_SCOPE("Load Cached Transport");
+		loaded = LoadCachedTransport(cacheFileName, key, srcImage.width, srcImage.height, result);
+	}
+	if (loaded)
+	{
+		printf("==================================\nOptimal Transport - %s\n==================================\nLoaded from %s\n\n", outputFileNameCSV, cacheFileName);
+		return;
+	}
+	#endif
+
+	result = TransportResult();
+	SlicedOptimalTransport(srcImage, targetImage, result.pixels, outputFileNameCSV, workspace);
+
+	#if TRANSPORT_CACHE() && DETERMINISTIC()
+	TRACE_SCOPE("Save Cached Transport");
+	if (!SaveCachedTransport(cacheFileName, key, srcImage.width, srcImage.height, result.pixels.data()))
+		printf("could not write %s\n", cacheFileName);
+	#endif
+}
+
+// Interpolates a block of values between the source image and the targets, with barycentric weights.
+// The source gets 1 minus the sum of the weights. Targets with a weight of 0 are not read at all.
+void InterpolateBlock(float* dest, const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<float>& weights, size_t begin, size_t count)
+{
+	float weightSum = 0.0f;
+	for (float weight : weights)
+		weightSum += weight;
+	const float u = 1.0f - weightSum;
+
+	// dest = src * u
+	{
+		const float* src = &srcImage.pixels[begin];
+		const __m256 weight8 = _mm256_set1_ps(u);
+		size_t index = 0;
+		for (; index + 8 <= count; index += 8)
+			_mm256_storeu_ps(&dest[index], _mm256_mul_ps(_mm256_loadu_ps(&src[index]), weight8));
+		for (; index < count; ++index)
+			dest[index] = src[index] * u;
+	}
+
+	// dest += target * weight
+	for (size_t targetIndex = 0; targetIndex < targets.size(); ++targetIndex)
+	{
+		const float weight = weights[targetIndex];
+		if (weight == 0.0f)
+			continue;
+
+		const float* target = &targets[targetIndex]->data()[begin];
+		const __m256 weight8 = _mm256_set1_ps(weight);
+		size_t index = 0;
+		for (; index + 8 <= count; index += 8)
+			_mm256_storeu_ps(&dest[index], _mm256_add_ps(_mm256_loadu_ps(&dest[index]), _mm256_mul_ps(_mm256_loadu_ps(&target[index]), weight8)));
+		for (; index < count; ++index)
+			dest[index] += target[index] * weight;
+	}
+}
+
+// Interpolates between the source image and any number of optimal transport results, with barycentric weights.
+// The image is done in blocks which stay in the L2 cache while each target is added in, so each target is read once.
+// Each block is converted straight into the pixels of the output image, so there is never a full float image.
+void InterpolateColorHistogramN(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<float>& weights, ImageWriteJob& output)
+{
+	PERF_COUNTER_REPORT("Interpolate " + output.fileName);
+	const size_t numValues = srcImage.pixels.size();
+	const int numBlocks = int((numValues + c_interpolateBlockSize - 1) / c_interpolateBlockSize);
+
+	#pragma omp parallel for
+	for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+	{
+		const size_t begin = size_t(blockIndex) * c_interpolateBlockSize;
+		const size_t count = std::min(c_interpolateBlockSize, numValues - begin);
+		alignas(32) float block[c_interpolateBlockSize];
+		InterpolateBlock(block, srcImage, targets, weights, begin, count);
+		StoreImageValues(output, begin, block, count);
+	}
+}
+
+void InterpolateColorHistogramN(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<float>& weights, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	ImageWriteJob output = MakeImageWriteJob(outputFileName, srcImage.width, srcImage.height);
+	InterpolateColorHistogramN(srcImage, targets, weights, output);
+	SubmitImage(std::move(output), writer);
+}
+
+// One output of InterpolateColorHistogramBatch
+struct InterpolationJob
+{
+	std::vector<float> weights = {}; // one per target
+	std::string fileName = {};
+	std::string histogramFileName = {}; // If not empty, a plot of the output's color histogram is written here
+};
+
+// Makes the color histogram of 3 channel uint8 pixels, and writes a plot of it
+bool WriteImageHistogram(const unsigned char* pixels, size_t numPixels, const char* fileName)
+{
+	TRACE_SCOPE("Write Histogram");
+	ColorHistogram histogram;
+	AddToHistogram(histogram, pixels, numPixels);
+	if (WriteHistogramPlot(fileName, histogram, c_histogramYLimit))
+		return true;
+
+	printf("could not write %s\n", fileName);
+	return false;
+}
+
+// Adds the pixels of an output image to a histogram
+void AddToHistogram(ColorHistogram& histogram, const ImageWriteJob& output)
+{
+	if (output.floatPixels.empty())
+	{
+		AddToHistogram(histogram, output.pixels.data(), output.pixels.size() / 3);
+	}
+	else
+	{
+		std::vector<unsigned char> pixels(output.floatPixels.size());
+		ConvertFloatToU8(pixels.data(), output.floatPixels.data(), pixels.size());
+		AddToHistogram(histogram, pixels.data(), pixels.size() / 3);
+	}
+}
+
+// Writes the histogram plots of the jobs that want one. The plots are small, so they are written in parallel.
+bool WriteJobHistograms(const std::vector<InterpolationJob>& jobs, const std::vector<ColorHistogram>& histograms)
+{
+	bool ret = true;
+	#pragma omp parallel for schedule(dynamic)
+	for (int jobIndex = 0; jobIndex < int(jobs.size()); ++jobIndex)
+	{
+		TRACE_SCOPE("Write Histogram");
+		const char* fileName = jobs[jobIndex].histogramFileName.c_str();
+		if (fileName[0] && !WriteHistogramPlot(fileName, histograms[jobIndex], c_histogramYLimit))
+		{
+			printf("could not write %s\n", fileName);
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+// Reports the roofline of making a batch of interpolations. The source and the targets that any job uses are read once,
+// and each job's output is written once.
+void ReportInterpolationRoofline(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<InterpolationJob>& jobs, double seconds)
+{
+	const double numValues = double(srcImage.pixels.size());
+	double bytes = numValues * sizeof(float);
+	double flops = 0.0;
+	for (size_t targetIndex = 0; targetIndex < targets.size(); ++targetIndex)
+	{
+		bool used = false;
+		for (const InterpolationJob& job : jobs)
+			used |= (job.weights[targetIndex] != 0.0f);
+		if (used)
+			bytes += numValues * sizeof(float);
+	}
+	for (const InterpolationJob& job : jobs)
+	{
+		bytes += numValues * (HasExtension(job.fileName.c_str(), "pfm") ? sizeof(float) : 1);
+		flops += numValues;
+		for (float weight : job.weights)
+			flops += (weight != 0.0f) ? numValues * 2 : 0.0;
+	}
+
+	PrintRoofline("Interpolation roofline", { { "Interpolate", bytes, flops, seconds } }, MeasuredMachineRoof());
+}
+
+// Like InterpolateColorHistogramBatch, but streams the outputs to their files a band of rows at a time, instead of
+// making whole images. Each output only needs a band of pixels in memory. The bands of the outputs are encoded in parallel.
+// With PERF_COUNTERS(), the interpolation is counted for all of the outputs together, since each block makes all of them,
+// and the encoding is counted for each output.
+// Returns false if any output could not be written.
+bool InterpolateColorHistogramBatchStreamed(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<InterpolationJob>& jobs)
+{
+	const int width = srcImage.width;
+	const int height = srcImage.height;
+	const int numJobs = int(jobs.size());
+
+	std::vector<ImageStreamWriter> streams(numJobs);
+	std::vector<char> failed(numJobs, 0);
+	for (int jobIndex = 0; jobIndex < numJobs; ++jobIndex)
+		failed[jobIndex] = !streams[jobIndex].Open(jobs[jobIndex].fileName.c_str(), width, height);
+
+	const size_t bandSize = size_t(c_streamBandRows) * width * 3;
+	std::vector<std::vector<unsigned char>> bands(numJobs, std::vector<unsigned char>(bandSize));
+	std::vector<ColorHistogram> histograms(numJobs);
+	double interpolateSeconds = 0.0;
+	#if PERF_COUNTERS()
+	PerfCounterValues interpolateCounters;
+	std::vector<PerfCounterValues> encodeCounters(numJobs);
+	#endif
+	for (int bandRow = 0; bandRow < height; bandRow += c_streamBandRows)
+	{
+		const int bandRows = std::min(c_streamBandRows, height - bandRow);
+		const size_t bandBegin = size_t(bandRow) * width * 3;
+		const size_t bandValues = size_t(bandRows) * width * 3;
+		const int numBlocks = int((bandValues + c_interpolateBlockSize - 1) / c_interpolateBlockSize);
+
+		// Make the band of every output, a block at a time
+		std::chrono::steady_clock::time_point interpolateStart = std::chrono::steady_clock::now();
+		{
+			PERF_COUNTER_SCOPE(interpolateCounters, true);
+			#pragma omp parallel for
+			for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+			{
+				TRACE_SCOPE("Interpolate Block");
+				const size_t offset = size_t(blockIndex) * c_interpolateBlockSize;
+				const size_t count = std::min(c_interpolateBlockSize, bandValues - offset);
+				alignas(32) float block[c_interpolateBlockSize];
+				for (int jobIndex = 0; jobIndex < numJobs; ++jobIndex)
+				{
+					InterpolateBlock(block, srcImage, targets, jobs[jobIndex].weights, bandBegin + offset, count);
+					ConvertFloatToU8(&bands[jobIndex][offset], block, count);
+				}
+			}
+		}
+		interpolateSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - interpolateStart).count();
+
+		// Encode the bands and add them to the histograms, one output per thread
+		#pragma omp parallel for schedule(dynamic)
+		for (int jobIndex = 0; jobIndex < numJobs; ++jobIndex)
+		{
+			TRACE_SCOPE("Encode Band");
+			PERF_COUNTER_SCOPE(encodeCounters[jobIndex], false);
+			if (!failed[jobIndex])
+				failed[jobIndex] = !streams[jobIndex].WriteRows(bands[jobIndex].data(), bandRows);
+			if (!jobs[jobIndex].histogramFileName.empty())
+				AddToHistogram(histograms[jobIndex], bands[jobIndex].data(), size_t(bandRows) * width);
+		}
+	}
+
+	bool ret = true;
+	for (int jobIndex = 0; jobIndex < numJobs; ++jobIndex)
+	{
+		if (!streams[jobIndex].Close() || failed[jobIndex])
+		{
+			printf("could not write %s\n", jobs[jobIndex].fileName.c_str());
+			ret = false;
+		}
+	}
+	ret &= WriteJobHistograms(jobs, histograms);
+
+	#if PERF_COUNTERS()
+	PrintPerfCounters("Interpolate " + std::to_string(numJobs) + " images, streamed", interpolateCounters);
+	for (int jobIndex = 0; jobIndex < numJobs; ++jobIndex)
+		PrintPerfCounters("Save " + jobs[jobIndex].fileName + ", streamed", encodeCounters[jobIndex]);
+	#endif
+
+	#if ROOFLINE_REPORT()
+	ReportInterpolationRoofline(srcImage, targets, jobs, interpolateSeconds);
+	#endif
+	(void)interpolateSeconds;
+	return ret;
+}
+
+// Makes many interpolations between the source image and the same targets, in one pass over the images.
+// Each block of the source and targets is read into the cache once, and the block of every output is made from it,
+// so the source and targets are read from memory once, instead of once per output.
+// Returns false if a histogram plot, or an output written on this thread, could not be written. Outputs given to a
+// writer report their failures from its Flush.
+bool InterpolateColorHistogramBatch(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<InterpolationJob>& jobs, AsyncImageWriter* writer = nullptr)
+{
+	PERF_COUNTER_REPORT("Interpolate " + std::to_string(jobs.size()) + " images");
+	std::vector<ImageWriteJob> outputs;
+	for (const InterpolationJob& job : jobs)
+		outputs.push_back(MakeImageWriteJob(job.fileName.c_str(), srcImage.width, srcImage.height));
+
+	const size_t numValues = srcImage.pixels.size();
+	const int numBlocks = int((numValues + c_interpolateBlockSize - 1) / c_interpolateBlockSize);
+
+	std::chrono::steady_clock::time_point interpolateStart = std::chrono::steady_clock::now();
+	#pragma omp parallel for
+	for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+	{
+		TRACE_SCOPE("Interpolate Block");
+		const size_t begin = size_t(blockIndex) * c_interpolateBlockSize;
+		const size_t count = std::min(c_interpolateBlockSize, numValues - begin);
+		alignas(32) float block[c_interpolateBlockSize];
+		for (size_t jobIndex = 0; jobIndex < jobs.size(); ++jobIndex)
+		{
+			InterpolateBlock(block, srcImage, targets, jobs[jobIndex].weights, begin, count);
+			StoreImageValues(outputs[jobIndex], begin, block, count);
+		}
+	}
+
+	#if ROOFLINE_REPORT()
+	ReportInterpolationRoofline(srcImage, targets, jobs, std::chrono::duration<double>(std::chrono::steady_clock::now() - interpolateStart).count());
+	#endif
+	(void)interpolateStart;
+
+	// Make the histograms while the outputs are in memory
+	std::vector<ColorHistogram> histograms(jobs.size());
+	#pragma omp parallel for
+	for (int jobIndex = 0; jobIndex < int(jobs.size()); ++jobIndex)
+	{
+		if (!jobs[jobIndex].histogramFileName.empty())
+			AddToHistogram(histograms[jobIndex], outputs[jobIndex]);
+	}
+	bool ret = WriteJobHistograms(jobs, histograms);
+
+	// Save output images
+	for (ImageWriteJob& output : outputs)
+		ret &= SubmitImage(std::move(output), writer);
+	return ret;
+}
+
+// Like InterpolateColorHistogramBatch, but makes each output with its own pass over the images, by InterpolateColorHistogramN.
+// It reads the source and targets once per output, so it is slower, and is here to compare against the batch.
+// Returns false in the same cases as InterpolateColorHistogramBatch.
+bool InterpolateColorHistogramSeparately(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<InterpolationJob>& jobs, AsyncImageWriter* writer = nullptr)
+{
+	bool ret = true;
+	std::vector<ColorHistogram> histograms(jobs.size());
+	for (size_t jobIndex = 0; jobIndex < jobs.size(); ++jobIndex)
+	{
+		const InterpolationJob& job = jobs[jobIndex];
+		ImageWriteJob output = MakeImageWriteJob(job.fileName.c_str(), srcImage.width, srcImage.height);
+		InterpolateColorHistogramN(srcImage, targets, job.weights, output);
+		if (!job.histogramFileName.empty())
+			AddToHistogram(histograms[jobIndex], output);
+		ret &= SubmitImage(std::move(output), writer);
+	}
+	ret &= WriteJobHistograms(jobs, histograms);
+	return ret;
+}
+
+void InterpolateColorHistogram1D(const ImageData& srcImage, const TransportResult& target, float weight, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	InterpolateColorHistogramN(srcImage, { &target }, { weight }, outputFileName, writer);
+}
+
+void InterpolateColorHistogram2D(const ImageData& srcImage, const TransportResult& target1, float weight1, const TransportResult& target2, float weight2, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	InterpolateColorHistogramN(srcImage, { &target1, &target2 }, { weight1, weight2 }, outputFileName, writer);
+}
+
+// A blend weight per pixel. It is either an 8 bit mask, where 0 to 255 is a weight of 0 to 1, or a float per pixel.
+struct WeightMap
+{
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> mask;
+	std::vector<float> weights;
+};
+
+// Loads an image as an 8 bit mask. Color images are converted to grey.
+bool LoadWeightMap(WeightMap& weightMap, const char* fileName)
+{
+	int c;
+	stbi_uc* pixels = stbi_load(fileName, &weightMap.width, &weightMap.height, &c, 1);
+	if (!pixels)
+	{
+		printf("could not load %s\n", fileName);
+		return false;
+	}
+
+	weightMap.mask.assign(pixels, pixels + size_t(weightMap.width) * size_t(weightMap.height));
+	weightMap.weights.clear();
+	stbi_image_free(pixels);
+	return true;
+}
+
+inline float WeightAt(const WeightMap& weightMap, size_t pixelIndex)
+{
+	return weightMap.mask.empty() ? weightMap.weights[pixelIndex] : float(weightMap.mask[pixelIndex]) * (1.0f / 255.0f);
+}
+
+// Loads the weights of 8 pixels
+inline __m256 LoadWeights8(const WeightMap& weightMap, size_t pixelIndex)
+{
+	if (!weightMap.mask.empty())
+	{
+		__m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&weightMap.mask[pixelIndex]));
+		return _mm256_mul_ps(_mm256_cvtepi32_ps(values), _mm256_set1_ps(1.0f / 255.0f));
+	}
+	return _mm256_loadu_ps(&weightMap.weights[pixelIndex]);
+}
+
+// Spreads the weights of 8 pixels over their 24 RGB values
+inline void ExpandWeights8(__m256 weights, __m256 expanded[3])
+{
+	expanded[0] = _mm256_permutevar8x32_ps(weights, _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2));
+	expanded[1] = _mm256_permutevar8x32_ps(weights, _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5));
+	expanded[2] = _mm256_permutevar8x32_ps(weights, _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7));
+}
+
+// Interpolates between the source image and one or two targets, with weights that vary per pixel.
+// target2 and weightMap2 may be null. Each pixel's weights are read from the maps and applied to its RGB values in the
+// same pass, 8 pixels at a time.
+void InterpolateWeightMapped(const ImageData& srcImage, const TransportResult& target1, const WeightMap& weightMap1, const TransportResult* target2, const WeightMap* weightMap2, ImageWriteJob& output)
+{
+	PERF_COUNTER_REPORT("Interpolate " + output.fileName);
+	static const size_t c_blockPixels = c_interpolateBlockSize / 3;
+
+	const size_t numPixels = size_t(srcImage.width) * size_t(srcImage.height);
+	const int numBlocks = int((numPixels + c_blockPixels - 1) / c_blockPixels);
+	const float* src = srcImage.pixels.data();
+	const float* t1 = target1.data();
+	const float* t2 = target2 ? target2->data() : nullptr;
+
+	#pragma omp parallel for
+	for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+	{
+		const size_t beginPixel = size_t(blockIndex) * c_blockPixels;
+		const size_t endPixel = std::min(beginPixel + c_blockPixels, numPixels);
+		alignas(32) float block[c_blockPixels * 3];
+
+		size_t pixelIndex = beginPixel;
+		for (; pixelIndex + 8 <= endPixel; pixelIndex += 8)
+		{
+			const __m256 v8 = LoadWeights8(weightMap1, pixelIndex);
+			const __m256 w8 = t2 ? LoadWeights8(*weightMap2, pixelIndex) : _mm256_setzero_ps();
+			const __m256 u8 = _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(v8, w8));
+
+			__m256 u[3], v[3], w[3];
+			ExpandWeights8(u8, u);
+			ExpandWeights8(v8, v);
+			ExpandWeights8(w8, w);
+
+			for (int i = 0; i < 3; ++i)
+			{
+				const size_t valueIndex = pixelIndex * 3 + i * 8;
+				__m256 value = _mm256_mul_ps(_mm256_loadu_ps(&src[valueIndex]), u[i]);
+				value = _mm256_add_ps(value, _mm256_mul_ps(_mm256_loadu_ps(&t1[valueIndex]), v[i]));
+				if (t2)
+					value = _mm256_add_ps(value, _mm256_mul_ps(_mm256_loadu_ps(&t2[valueIndex]), w[i]));
+				_mm256_store_ps(&block[(pixelIndex - beginPixel) * 3 + i * 8], value);
+			}
+		}
+		for (; pixelIndex < endPixel; ++pixelIndex)
+		{
+			const float v = WeightAt(weightMap1, pixelIndex);
+			const float w = t2 ? WeightAt(*weightMap2, pixelIndex) : 0.0f;
+			const float u = 1.0f - (v + w);
+			for (int i = 0; i < 3; ++i)
+			{
+				const size_t valueIndex = pixelIndex * 3 + i;
+				float value = src[valueIndex] * u + t1[valueIndex] * v;
+				if (t2)
+					value += t2[valueIndex] * w;
+				block[(pixelIndex - beginPixel) * 3 + i] = value;
+			}
+		}
+
+		StoreImageValues(output, beginPixel * 3, block, (endPixel - beginPixel) * 3);
+	}
+}
+
+inline bool WeightMapMatches(const WeightMap& weightMap, const ImageData& image, const char* outputFileName)
+{
+	if (weightMap.width == image.width && weightMap.height == image.height)
+		return true;
+
+	printf("the weight map for %s is %ix%i, but the image is %ix%i\n", outputFileName, weightMap.width, weightMap.height, image.width, image.height);
+	return false;
+}
+
+// Like InterpolateColorHistogram1D, but with a weight per pixel.
+// Returns false if the weight map doesn't match the image, or the image could not be written.
+bool InterpolateColorHistogram1D(const ImageData& srcImage, const TransportResult& target, const WeightMap& weightMap, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	if (!WeightMapMatches(weightMap, srcImage, outputFileName))
+		return false;
+
+	ImageWriteJob output = MakeImageWriteJob(outputFileName, srcImage.width, srcImage.height);
+	InterpolateWeightMapped(srcImage, target, weightMap, nullptr, nullptr, output);
+	return SubmitImage(std::move(output), writer);
+}
+
+// Like InterpolateColorHistogram2D, but with weights per pixel.
+// Returns false if a weight map doesn't match the image, or the image could not be written.
+bool InterpolateColorHistogram2D(const ImageData& srcImage, const TransportResult& target1, const WeightMap& weightMap1, const TransportResult& target2, const WeightMap& weightMap2, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	if (!WeightMapMatches(weightMap1, srcImage, outputFileName) || !WeightMapMatches(weightMap2, srcImage, outputFileName))
+		return false;
+
+	ImageWriteJob output = MakeImageWriteJob(outputFileName, srcImage.width, srcImage.height);
+	InterpolateWeightMapped(srcImage, target1, weightMap1, &target2, &weightMap2, output);
+	return SubmitImage(std::move(output), writer);
+}
+
+// Makes a float weight map that ramps from 0 at the left to maxWeight at the right
+void MakeRampWeightMap(WeightMap& weightMap, int width, int height, float maxWeight)
+{
+	weightMap.width = width;
+	weightMap.height = height;
+	weightMap.mask.clear();
+	weightMap.weights.resize(size_t(width) * size_t(height));
+	const float scale = maxWeight / float(std::max(width - 1, 1));
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+			weightMap.weights[size_t(y) * width + x] = float(x) * scale;
+	}
+}
+
+// Writes outputs whose weights ramp across the image. The 1d one uses a float weight map. The 2d one also uses an
+// 8 bit mask that ramps down the image, which is written as an image and loaded back the way a painted mask would be.
+// The two weights of a pixel add up to at most 1.
+bool WriteWeightMapOutputs(const ImageData& srcImage, const TransportResult& OTTurtle, const TransportResult& OTDunes, const TransportResult& OTBigCat)
+{
+	WeightMap acrossFull, acrossHalf;
+	MakeRampWeightMap(acrossFull, srcImage.width, srcImage.height, 1.0f);
+	MakeRampWeightMap(acrossHalf, srcImage.width, srcImage.height, 0.5f);
+
+	// The mask ramps from 0 at the top to 127, a weight of just under 0.5, at the bottom
+	static const char* c_maskFileName = "out/weightmap_down.png";
+	std::vector<unsigned char> maskPixels(size_t(srcImage.width) * size_t(srcImage.height));
+	for (int y = 0; y < srcImage.height; ++y)
+		memset(&maskPixels[size_t(y) * srcImage.width], (127 * y) / std::max(srcImage.height - 1, 1), srcImage.width);
+	if (!WritePNGParallel(c_maskFileName, srcImage.width, srcImage.height, 1, maskPixels.data()))
+	{
+		printf("could not write %s\n", c_maskFileName);
+		return false;
+	}
+
+	WeightMap downMask;
+	if (!LoadWeightMap(downMask, c_maskFileName))
+		return false;
+
+	bool ret = InterpolateColorHistogram1D(srcImage, OTBigCat, acrossFull, "out/florida-bigcat_ramp.png");
+	ret &= InterpolateColorHistogram2D(srcImage, OTTurtle, acrossHalf, OTDunes, downMask, "out/florida-turtle_dunes_ramp.png");
+	return ret;
+}
+
+// A displacement field can only be used with the image it was made from. One from another image, or a stale file,
+// would read and write past the ends of the images.
+inline bool DisplacementFieldMatches(const DisplacementFieldReader& field, const ImageData& image, const char* outputFileName)
+{
+	if (field.Width() == image.width && field.Height() == image.height)
+		return true;
+
+	printf("the displacement field for %s is %ix%i, but the image is %ix%i\n", outputFileName, field.Width(), field.Height(), image.width, image.height);
+	return false;
+}
+
+// Like InterpolateColorHistogram1D above, but reads the optimal transport result from a displacement field, a strip of rows at a time.
+// src * u + (src + displacement) * v is src + displacement * v.
+// Returns false if the field doesn't match the image, or could not be read.
+bool InterpolateColorHistogram1D(const ImageData& srcImage, DisplacementFieldReader& target, float weight, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	if (!DisplacementFieldMatches(target, srcImage, outputFileName))
+		return false;
+
+	ImageWriteJob output = MakeImageWriteJob(outputFileName, srcImage.width, srcImage.height);
+	std::vector<float> displacement(size_t(target.Width()) * target.RowsPerStrip() * 3);
+	for (int stripIndex = 0; stripIndex < target.NumStrips(); ++stripIndex)
+	{
+		if (!target.ReadStrip(stripIndex, displacement.data()))
+		{
+			printf("could not read displacement field for %s\n", outputFileName);
+			return false;
+		}
+
+		// The strip's displacements become its output values, and are then stored into the output image
+		const size_t begin = size_t(stripIndex) * target.RowsPerStrip() * srcImage.width * 3;
+		const size_t numValues = size_t(target.StripRows(stripIndex)) * srcImage.width * 3;
+		const float* src = &srcImage.pixels[begin];
+		for (size_t valueIndex = 0; valueIndex < numValues; ++valueIndex)
+			displacement[valueIndex] = src[valueIndex] + displacement[valueIndex] * weight;
+		StoreImageValues(output, begin, displacement.data(), numValues);
+	}
+
+	// Save output image
+	return SubmitImage(std::move(output), writer);
+}
+
+bool InterpolateColorHistogram2D(const ImageData& srcImage, DisplacementFieldReader& target1, float weight1, DisplacementFieldReader& target2, float weight2, const char* outputFileName, AsyncImageWriter* writer = nullptr)
+{
+	if (!DisplacementFieldMatches(target1, srcImage, outputFileName) || !DisplacementFieldMatches(target2, srcImage, outputFileName))
+		return false;
+
+	if (target1.RowsPerStrip() != target2.RowsPerStrip())
+	{
+		printf("displacement fields for %s have different strip sizes\n", outputFileName);
+		return false;
+	}
+
+	ImageWriteJob output = MakeImageWriteJob(outputFileName, srcImage.width, srcImage.height);
+	std::vector<float> displacement1(size_t(target1.Width()) * target1.RowsPerStrip() * 3);
+	std::vector<float> displacement2(displacement1.size());
+	for (int stripIndex = 0; stripIndex < target1.NumStrips(); ++stripIndex)
+	{
+		if (!target1.ReadStrip(stripIndex, displacement1.data()) || !target2.ReadStrip(stripIndex, displacement2.data()))
+		{
+			printf("could not read displacement field for %s\n", outputFileName);
+			return false;
+		}
+
+		const size_t begin = size_t(stripIndex) * target1.RowsPerStrip() * srcImage.width * 3;
+		const size_t numValues = size_t(target1.StripRows(stripIndex)) * srcImage.width * 3;
+		const float* src = &srcImage.pixels[begin];
+		for (size_t valueIndex = 0; valueIndex < numValues; ++valueIndex)
+			displacement1[valueIndex] = src[valueIndex] + displacement1[valueIndex] * weight1 + displacement2[valueIndex] * weight2;
+		StoreImageValues(output, begin, displacement1.data(), numValues);
+	}
+
+	// Save output image
+	return SubmitImage(std::move(output), writer);
+}
+
+// Writes an optimal transport result as a displacement field, then reads it back and reports how much it differs
+void SaveDisplacementField(const ImageData& srcImage, const TransportResult& result, const char* fileName)
+{
+	DisplacementFieldOptions options;
+	options.bits = c_displacementFieldBits;
+	if (!WriteDisplacementField(fileName, srcImage.width, srcImage.height, srcImage.pixels.data(), result.data(), options))
+	{
+		printf("could not write %s\n", fileName);
+		return;
+	}
+
+	DisplacementFieldReader reader;
+	if (!reader.Open(fileName))
+	{
+		printf("could not read %s\n", fileName);
+		return;
+	}
+
+	std::vector<float> readBack = srcImage.pixels;
+	std::vector<float> displacement(size_t(reader.Width()) * reader.RowsPerStrip() * 3);
+	for (int stripIndex = 0; stripIndex < reader.NumStrips(); ++stripIndex)
+	{
+		if (!reader.ReadStrip(stripIndex, displacement.data()))
+		{
+			printf("could not read %s\n", fileName);
+			return;
+		}
+
+		float* pixels = &readBack[size_t(stripIndex) * reader.RowsPerStrip() * reader.Width() * 3];
+		const size_t numValues = size_t(reader.StripRows(stripIndex)) * reader.Width() * 3;
+		for (size_t valueIndex = 0; valueIndex < numValues; ++valueIndex)
+			pixels[valueIndex] += displacement[valueIndex];
+	}
+
+	const double fileSizeMB = double(reader.FileSize()) / (1024.0 * 1024.0);
+	const double floatSizeMB = double(result.size() * sizeof(float)) / (1024.0 * 1024.0);
+
+	char label[1024];
+	sprintf_s(label, "%s: %0.2f MB, %0.1fx smaller than %0.2f MB of floats", fileName, fileSizeMB, floatSizeMB / fileSizeMB, floatSizeMB);
+	ReportAccuracy(label, result.data(), readBack.data(), readBack.size());
+}
+
+// Makes the 3d color histogram of 3 channel uint8 or float pixels, writes it, and reports how many bins it uses
+template <typename T>
+void SaveJointHistogram(const T* pixels, size_t numPixels, const char* fileName)
+{
+	std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+	JointHistogram histogram;
+	BuildJointHistogram(histogram, pixels, numPixels, c_jointHistogramBits);
+	std::chrono::duration<float> seconds = std::chrono::high_resolution_clock::now() - timeStart;
+
+	if (!WriteJointHistogram(fileName, histogram))
+	{
+		printf("could not write %s\n", fileName);
+		return;
+	}
+	printf("%s: %zu of %u bins used, made in %0.2f ms\n", fileName, histogram.bins.size(), 1u << (histogram.bits * 3), seconds.count() * 1000.0f);
+}
+
+// Half size copies of the source image and the optimal transport results, for fast previews of blends.
+// Blending is linear, so blending the downsampled images is the same as downsampling the blend.
+// Level 0 is full size and uses the images the pyramid was made from. Level n is 1 / 2^n the size.
+struct PreviewPyramid
+{
+	struct Level
+	{
+		ImageData srcImage;
+		std::vector<TransportResult> targets;
+	};
+
+	const ImageData* srcImage = nullptr;
+	std::vector<const TransportResult*> targets;
+	std::vector<Level> levels; // levels[0] is level 1
+
+	int NumLevels() const
+	{
+		return int(levels.size()) + 1;
+	}
+
+	// Gets the source and targets of a level
+	const ImageData& LevelSource(int level) const
+	{
+		return (level == 0) ? *srcImage : levels[level - 1].srcImage;
+	}
+
+	std::vector<const TransportResult*> LevelTargets(int level) const
+	{
+		if (level == 0)
+			return targets;
+
+		std::vector<const TransportResult*> ret;
+		for (const TransportResult& target : levels[level - 1].targets)
+			ret.push_back(&target);
+		return ret;
+	}
+};
+
+// Averages 2x2 blocks of RGB pixels. Odd sizes round up, and the last row or column is repeated.
+void DownsampleHalf(std::vector<float>& dest, const float* src, int width, int height, int& halfWidth, int& halfHeight)
+{
+	halfWidth = (width + 1) / 2;
+	halfHeight = (height + 1) / 2;
+	dest.resize(size_t(halfWidth) * size_t(halfHeight) * 3);
+
+	#pragma omp parallel for
+	for (int y = 0; y < halfHeight; ++y)
+	{
+		const float* row0 = &src[size_t(y * 2) * width * 3];
+		const float* row1 = &src[size_t(std::min(y * 2 + 1, height - 1)) * width * 3];
+		float* destRow = &dest[size_t(y) * halfWidth * 3];
+		for (int x = 0; x < halfWidth; ++x)
+		{
+			const int x0 = x * 2 * 3;
+			const int x1 = std::min(x * 2 + 1, width - 1) * 3;
+			for (int i = 0; i < 3; ++i)
+				destRow[x * 3 + i] = (row0[x0 + i] + row0[x1 + i] + row1[x0 + i] + row1[x1 + i]) * 0.25f;
+		}
+	}
+}
+
+// Makes the pyramid once, so that previews at any level can be made quickly. The images must outlive the pyramid.
+void BuildPreviewPyramid(PreviewPyramid& pyramid, const ImageData& srcImage, const std::vector<const TransportResult*>& targets, int numLevels)
+{
+	pyramid.srcImage = &srcImage;
+	pyramid.targets = targets;
+	pyramid.levels.clear();
+	pyramid.levels.resize(std::max(numLevels - 1, 0));
+
+	for (int level = 1; level < numLevels; ++level)
+	{
+		const ImageData& parentSource = pyramid.LevelSource(level - 1);
+		const std::vector<const TransportResult*> parentTargets = pyramid.LevelTargets(level - 1);
+		PreviewPyramid::Level& dest = pyramid.levels[level - 1];
+
+		DownsampleHalf(dest.srcImage.pixels, parentSource.pixels.data(), parentSource.width, parentSource.height, dest.srcImage.width, dest.srcImage.height);
+		dest.targets.resize(parentTargets.size());
+		for (size_t targetIndex = 0; targetIndex < parentTargets.size(); ++targetIndex)
+		{
+			int halfWidth, halfHeight;
+			DownsampleHalf(dest.targets[targetIndex].pixels, parentTargets[targetIndex]->data(), parentSource.width, parentSource.height, halfWidth, halfHeight);
+		}
+	}
+}
+
+// Blends a level of the pyramid into uint8 RGB pixels, clamped and truncated like the saved images
+void PreviewBlend(const PreviewPyramid& pyramid, const std::vector<float>& weights, int level, ImageDataU8& preview)
+{
+	const ImageData& srcImage = pyramid.LevelSource(level);
+	const std::vector<const TransportResult*> targets = pyramid.LevelTargets(level);
+
+	preview.width = srcImage.width;
+	preview.height = srcImage.height;
+	preview.pixels.resize(srcImage.pixels.size());
+
+	const size_t numValues = srcImage.pixels.size();
+	const int numBlocks = int((numValues + c_interpolateBlockSize - 1) / c_interpolateBlockSize);
+
+	#pragma omp parallel for if (numBlocks > 1)
+	for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+	{
+		const size_t begin = size_t(blockIndex) * c_interpolateBlockSize;
+		const size_t count = std::min(c_interpolateBlockSize, numValues - begin);
+		alignas(32) float block[c_interpolateBlockSize];
+		InterpolateBlock(block, srcImage, targets, weights, begin, count);
+		ConvertFloatToU8(&preview.pixels[begin], block, count);
+	}
+}
+
+// A preview which starts at the smallest level when the weights change, and is refined a level at a time towards
+// full size. A UI calls SetWeights while the weights are being dragged, and Refine while they are not changing.
+struct ProgressivePreview
+{
+	ProgressivePreview(const PreviewPyramid& pyramid)
+		: m_pyramid(pyramid)
+	{
+	}
+
+	// Makes a preview at the smallest level right away
+	void SetWeights(const std::vector<float>& weights)
+	{
+		m_weights = weights;
+		m_level = m_pyramid.NumLevels() - 1;
+		PreviewBlend(m_pyramid, m_weights, m_level, m_image);
+	}
+
+	// Makes the preview one level bigger. Returns false when it is already full size.
+	bool Refine()
+	{
+		if (m_level <= 0)
+			return false;
+
+		m_level--;
+		PreviewBlend(m_pyramid, m_weights, m_level, m_image);
+		return true;
+	}
+
+	const ImageDataU8& Image() const { return m_image; }
+	int Level() const { return m_level; }
+
+	const PreviewPyramid& m_pyramid;
+	std::vector<float> m_weights;
+	int m_level = 0;
+	ImageDataU8 m_image;
+};
+
+// Reports how long the preview pyramid takes to make, and how long each level of a preview takes.
+// Each level's preview is written to out/preview_level<N>.png, outside of the times. Level 0 is the full size blend.
+void ReportPreviewTiming(const ImageData& srcImage, const std::vector<const TransportResult*>& targets, const std::vector<float>& weights)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	auto Milliseconds = [] (Clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(Clock::now() - start).count();
+	};
+
+	Clock::time_point start = Clock::now();
+	PreviewPyramid pyramid;
+	BuildPreviewPyramid(pyramid, srcImage, targets, c_previewLevels);
+	printf("Preview pyramid: %i levels in %0.2f ms\n", pyramid.NumLevels(), Milliseconds(start));
+
+	ProgressivePreview preview(pyramid);
+	start = Clock::now();
+	preview.SetWeights(weights);
+	do
+	{
+		printf("  level %i (%ix%i): %0.2f ms\n", preview.Level(), preview.Image().width, preview.Image().height, Milliseconds(start));
+
+		char fileName[1024];
+		sprintf_s(fileName, "out/preview_level%i.png", preview.Level());
+		if (!WritePNGParallel(fileName, preview.Image().width, preview.Image().height, 3, preview.Image().pixels.data()))
+			printf("could not write %s\n", fileName);
+		start = Clock::now();
+	}
+	while (preview.Refine());
+	printf("\n");
+}
+
+// The sliced Wasserstein distance between colors and targetColors: the root mean square difference of their sorted
+// projections onto a direction, averaged over random directions. It is 0 when the color histograms match.
+// The directions are the same every time, so distances can be compared.
+double SlicedWassersteinDistance(const float* colors, const unsigned char* targetColors, uint32_t numPixels, int numDirections)
+{
+	std::mt19937 rng(0);
+	std::normal_distribution<float> normalDist(0.0f, 1.0f);
+	std::vector<float> projections(numPixels);
+	std::vector<float> targetProjections(numPixels);
+
+	// The pixels are done in blocks, so the parallel loops count with ints
+	static const uint32_t c_blockPixels = 64 * 1024;
+	const int numBlocks = int((uint64_t(numPixels) + c_blockPixels - 1) / c_blockPixels);
+
+	double totalDistance = 0.0;
+	for (int directionIndex = 0; directionIndex < numDirections; ++directionIndex)
+	{
+		float direction[3] = { normalDist(rng), normalDist(rng), normalDist(rng) };
+		float length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+		direction[0] /= length;
+		direction[1] /= length;
+		direction[2] /= length;
+
+		#pragma omp parallel for
+		for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+		{
+			const size_t begin = size_t(blockIndex) * c_blockPixels;
+			const size_t end = std::min(begin + c_blockPixels, size_t(numPixels));
+			for (size_t i = begin; i < end; ++i)
+			{
+				projections[i] = direction[0] * colors[i * 3 + 0] + direction[1] * colors[i * 3 + 1] + direction[2] * colors[i * 3 + 2];
+				targetProjections[i] = direction[0] * float(targetColors[i * 3 + 0]) + direction[1] * float(targetColors[i * 3 + 1]) + direction[2] * float(targetColors[i * 3 + 2]);
+			}
+		}
+
+		#pragma omp parallel sections
+		{
+			#pragma omp section
+			std::sort(projections.begin(), projections.end());
+			#pragma omp section
+			std::sort(targetProjections.begin(), targetProjections.end());
+		}
+
+		double totalSquared = 0.0;
+		#pragma omp parallel for reduction(+:totalSquared)
+		for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+		{
+			const size_t begin = size_t(blockIndex) * c_blockPixels;
+			const size_t end = std::min(begin + c_blockPixels, size_t(numPixels));
+			for (size_t i = begin; i < end; ++i)
+			{
+				const double difference = double(projections[i]) - double(targetProjections[i]);
+				totalSquared += difference * difference;
+			}
+		}
+		totalDistance += std::sqrt(totalSquared / double(numPixels));
+	}
+	return totalDistance / double(numDirections);
+}
+
+// One solve of the benchmark
+struct BenchmarkRun
+{
+	const char* sweep;
+	SyntheticImage kind;
+	double megapixels;
+	int threads;
+	SOTOptions options;
+};
+
+// Makes a synthetic source and target, solves them, and writes how it went as a JSON object
+void RunBenchmarkSolve(FILE* file, const BenchmarkRun& run, const SyntheticPhoto& srcPhoto, const SyntheticPhoto& targetPhoto, SOTWorkspace& workspace)
+{
+	static const int c_errorDirections = 16;
+
+	// 4:3 images of the requested size
+	const int width = std::max(int(std::sqrt(run.megapixels * 1e6 * 4.0 / 3.0)), 1);
+	const int height = std::max(int(run.megapixels * 1e6 / double(width)), 1);
+	const uint32_t numPixels = uint32_t(width) * uint32_t(height);
+
+	ImageData srcImage;
+	ImageDataU8 targetImage;
+	{
+		std::vector<unsigned char> srcPixels;
+		MakeSyntheticImage(srcPixels, width, height, run.kind, 1, srcPhoto);
+		MakeSyntheticImage(targetImage.pixels, width, height, run.kind, 2, targetPhoto);
+		srcImage.width = targetImage.width = width;
+		srcImage.height = targetImage.height = height;
+		srcImage.pixels.resize(srcPixels.size());
+		ConvertU8ToFloat(srcImage.pixels.data(), srcPixels.data(), srcPixels.size());
+	}
+
+	const int maxThreads = omp_get_max_threads();
+	omp_set_num_threads(run.threads);
+	std::vector<float> results;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	SlicedOptimalTransport(srcImage, targetImage, results, nullptr, workspace, run.options);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	omp_set_num_threads(maxThreads);
+
+	const double initialError = SlicedWassersteinDistance(srcImage.pixels.data(), targetImage.pixels.data(), numPixels, c_errorDirections);
+	const double finalError = SlicedWassersteinDistance(results.data(), targetImage.pixels.data(), numPixels, c_errorDirections);
+	const size_t imageBytes = srcImage.pixels.size() * sizeof(float) + targetImage.pixels.size() + results.size() * sizeof(float);
+	const double throughput = double(numPixels) * run.options.numIterations / seconds;
+
+	// The workspace and image sizes are worked out from what was allocated. The peak process memory is measured, and is
+	// the peak of the whole benchmark so far, since it can't be reset.
+	fprintf(file,
+		"    { \"sweep\": \"%s\", \"image\": \"%s\", \"width\": %i, \"height\": %i, \"megapixels\": %0.3f, \"threads\": %i, "
+		"\"batchSize\": %i, \"batchesAtATime\": %i, \"storage\": \"%s\", \"iterations\": %i, \"seconds\": %0.4f, "
+		"\"workspaceMB\": %0.2f, \"estimatedWorkspaceAndImagesMB\": %0.2f, \"peakProcessMB\": %0.2f, \"pixelsIterationsPerSecond\": %0.0f, "
+		"\"initialSlicedWasserstein\": %0.5f, \"finalSlicedWasserstein\": %0.5f }",
+		run.sweep, SyntheticImageName(run.kind), width, height, double(numPixels) / 1e6, run.threads,
+		run.options.batchSize, workspace.numBatchSlots, SOTStorageName(run.options.storage), run.options.numIterations, seconds,
+		double(workspace.usedBytes) / (1024.0 * 1024.0), double(workspace.usedBytes + imageBytes) / (1024.0 * 1024.0),
+		double(PeakProcessMemoryBytes()) / (1024.0 * 1024.0), throughput, initialError, finalError);
+
+	printf("%s: %s %ix%i, %i threads, batch size %i, %s: %0.2f s, %0.2f M pixels x iterations / s, sliced Wasserstein %0.3f -> %0.3f\n",
+		run.sweep, SyntheticImageName(run.kind), width, height, run.threads, run.options.batchSize, SOTStorageName(run.options.storage),
+		seconds, throughput / 1e6, initialError, finalError);
+}
+
+// Solves synthetic images of many sizes and kinds, with different thread counts, batch sizes and solver modes,
+// and writes the time, memory, throughput and final error of each solve to a JSON file:
+// - size: each kind of image, at each of c_benchmarkMegapixels. With large, also the tiled photo at c_benchmarkLargeMegapixels.
+// - strong scaling: the same image with 1, 2, 4... threads
+// - weak scaling: c_benchmarkScalingMegapixels per thread, with 1, 2, 4... threads
+// - batch size: each of c_benchmarkBatchSizes
+// - solver mode: each SOTStorage
+// The tiled photos tile florida for the source, and bigcat for the target.
+// The size sweep is first, smallest to biggest, so the peak process memory of each of its runs is that run's own.
+bool RunBenchmark(const char* fileName, bool large)
+{
+	ImageDataU8 srcPhotoImage;
+	ImageDataU8 targetPhotoImage;
+	{
+		std::vector<ImageLoadJob> jobs(2);
+		jobs[0].fileName = "images/florida.png";
+		jobs[0].u8Image = &srcPhotoImage;
+		jobs[1].fileName = "images/bigcat.png";
+		jobs[1].u8Image = &targetPhotoImage;
+		if (!LoadImages(jobs))
+			return false;
+	}
+	const SyntheticPhoto srcPhoto = { srcPhotoImage.pixels.data(), srcPhotoImage.width, srcPhotoImage.height };
+	const SyntheticPhoto targetPhoto = { targetPhotoImage.pixels.data(), targetPhotoImage.width, targetPhotoImage.height };
+
+	SOTOptions options;
+	options.numIterations = c_benchmarkIterations;
+	options.memoryBudgetBytes = c_benchmarkMemoryBudgetBytes;
+	options.quiet = true;
+
+	const int maxThreads = omp_get_max_threads();
+	std::vector<int> threadCounts;
+	for (int threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	std::vector<BenchmarkRun> runs;
+	for (double megapixels : c_benchmarkMegapixels)
+	{
+		for (int kind = 0; kind < (int)SyntheticImage::Count; ++kind)
+			runs.push_back({ "size", (SyntheticImage)kind, megapixels, maxThreads, options });
+	}
+	if (large)
+		runs.push_back({ "size", SyntheticImage::TiledPhoto, c_benchmarkLargeMegapixels, maxThreads, options });
+	for (int threads : threadCounts)
+		runs.push_back({ "strong scaling", SyntheticImage::TiledPhoto, c_benchmarkScalingMegapixels, threads, options });
+	for (int threads : threadCounts)
+		runs.push_back({ "weak scaling", SyntheticImage::TiledPhoto, c_benchmarkScalingMegapixels * threads, threads, options });
+	for (int batchSize : c_benchmarkBatchSizes)
+	{
+		BenchmarkRun run = { "batch size", SyntheticImage::TiledPhoto, c_benchmarkScalingMegapixels, maxThreads, options };
+		run.options.batchSize = batchSize;
+		runs.push_back(run);
+	}
+	for (SOTStorage storage : { SOTStorage::Float32, SOTStorage::Float16, SOTStorage::BFloat16, SOTStorage::FixedPoint })
+	{
+		BenchmarkRun run = { "solver mode", SyntheticImage::TiledPhoto, c_benchmarkScalingMegapixels, maxThreads, options };
+		run.options.storage = storage;
+		runs.push_back(run);
+	}
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+	{
+		printf("could not write %s\n", fileName);
+		return false;
+	}
+
+	fprintf(file, "{\n  \"maxThreads\": %i,\n  \"runs\": [\n", maxThreads);
+	SOTWorkspace workspace;
+	for (size_t runIndex = 0; runIndex < runs.size(); ++runIndex)
+	{
+		RunBenchmarkSolve(file, runs[runIndex], srcPhoto, targetPhoto, workspace);
+		fprintf(file, "%s\n", (runIndex + 1 < runs.size()) ? "," : "");
+		fflush(file);
+	}
+	fprintf(file, "  ]\n}\n");
+	return fclose(file) == 0;
+}
+
+// A captured projection, in the units of the float projections
+double CapturedProjection(const ProjectionCapture& capture, const std::vector<unsigned char>& projections, uint32_t pixelIndex)
+{
+	const unsigned char* bytes = &projections[size_t(pixelIndex) * capture.elementBytes];
+	switch ((SOTStorage)capture.storage)
+	{
+		case SOTStorage::Float32: { float value; memcpy(&value, bytes, sizeof(value)); return value; }
+		case SOTStorage::Float16: { Half value; memcpy(&value, bytes, sizeof(value)); return ToFloat(value); }
+		case SOTStorage::BFloat16: { BFloat16 value; memcpy(&value, bytes, sizeof(value)); return ToFloat(value); }
+		case SOTStorage::FixedPoint: { uint32_t key; memcpy(&key, bytes, sizeof(key)); return double(int32_t(key ^ 0x80000000)) / double(1 << c_fixedProjectionBits); }
+	}
+	return 0.0;
+}
+
+// Writes captured projections into a batch's projection array, converted to storage if they were captured with another
+void LoadCapturedProjections(void* dest, SOTStorage storage, const ProjectionCapture& capture, const std::vector<unsigned char>& projections)
+{
+	if ((SOTStorage)capture.storage == storage)
+	{
+		memcpy(dest, projections.data(), projections.size());
+		return;
+	}
+
+	for (uint32_t i = 0; i < capture.numPixels; ++i)
+	{
+		const double value = CapturedProjection(capture, projections, i);
+		switch (storage)
+		{
+			case SOTStorage::Float32: FromFloat(((float*)dest)[i], float(value)); break;
+			case SOTStorage::Float16: FromFloat(((Half*)dest)[i], float(value)); break;
+			case SOTStorage::BFloat16: FromFloat(((BFloat16*)dest)[i], float(value)); break;
+			case SOTStorage::FixedPoint: ((uint32_t*)dest)[i] = uint32_t(int32_t(std::llround(value * double(1 << c_fixedProjectionBits)))) ^ 0x80000000; break;
+		}
+	}
+}
+
+// How many different values there are in captured projections. The fewer there are, the more ties the sorts have.
+uint32_t CountDistinctProjections(const ProjectionCapture& capture, const std::vector<unsigned char>& projections)
+{
+	std::vector<double> values(capture.numPixels);
+	for (uint32_t i = 0; i < capture.numPixels; ++i)
+		values[i] = CapturedProjection(capture, projections, i);
+	std::sort(values.begin(), values.end());
+	return uint32_t(std::unique(values.begin(), values.end()) - values.begin());
+}
+
+// Runs the sorts and matching of every storage type on captured projections, and reports the fastest of c_replayRuns runs of each.
+// The sorted index lists start as the identity, like on the first iteration of a solve.
+bool ReplayProjections(const char* fileName)
+{
+	ProjectionCapture capture;
+	if (!ReadProjectionCapture(fileName, capture) || capture.storage > uint32_t(SOTStorage::FixedPoint) ||
+		capture.elementBytes != SOTStorageBytes((SOTStorage)capture.storage))
+	{
+		printf("could not read %s\n", fileName);
+		return false;
+	}
+
+	printf("%s: %u pixels, %s, iteration %u, batch %u\n", fileName, capture.numPixels, SOTStorageName((SOTStorage)capture.storage), capture.iteration, capture.batchIndex);
+	printf("  %u distinct current projections, %u distinct target projections\n",
+		CountDistinctProjections(capture, capture.currentProjections), CountDistinctProjections(capture, capture.targetProjections));
+
+	SOTWorkspace workspace;
+	for (SOTStorage storage : { SOTStorage::Float32, SOTStorage::Float16, SOTStorage::BFloat16, SOTStorage::FixedPoint })
+	{
+		workspace.Reserve(capture.numPixels, storage, 1, 0);
+		const BatchData& batchData = workspace.batches[0];
+
+		double bestSeconds[(int)SOTStage::Count];
+		std::fill(bestSeconds, bestSeconds + (int)SOTStage::Count, 1e30);
+		for (int run = 0; run < c_replayRuns; ++run)
+		{
+			LoadCapturedProjections(batchData.currentProjections, storage, capture, capture.currentProjections);
+			LoadCapturedProjections(batchData.targetProjections, storage, capture, capture.targetProjections);
+			for (uint32_t i = 0; i < capture.numPixels; ++i)
+			{
+				batchData.currentSorted[i] = i;
+				batchData.targetSorted[i] = i;
+			}
+
+			SOTStageTimes times;
+			times.Start();
+			switch (storage)
+			{
+				case SOTStorage::Float32: SOTSortAndMatch<float>(batchData, capture.direction, capture.numPixels, times); break;
+				case SOTStorage::Float16: SOTSortAndMatch<Half>(batchData, capture.direction, capture.numPixels, times); break;
+				case SOTStorage::BFloat16: SOTSortAndMatch<BFloat16>(batchData, capture.direction, capture.numPixels, times); break;
+				case SOTStorage::FixedPoint:
+				{
+					int16_t directionFixed[3];
+					QuantizeDirectionFixed(directionFixed, capture.direction);
+					SOTSortAndMatchFixedPoint(batchData, directionFixed, capture.numPixels, times);
+					break;
+				}
+			}
+
+			for (int stageIndex = 0; stageIndex < (int)SOTStage::Count; ++stageIndex)
+				bestSeconds[stageIndex] = std::min(bestSeconds[stageIndex], times.seconds[stageIndex]);
+		}
+
+		const double currentSortSeconds = bestSeconds[(int)SOTStage::CurrentSort];
+		const double targetSortSeconds = bestSeconds[(int)SOTStage::TargetSort];
+		printf("  %-12s current sort %8.3f ms, target sort %8.3f ms, matching %8.3f ms, %0.1f M keys sorted / s\n", SOTStorageName(storage),
+			currentSortSeconds * 1000.0, targetSortSeconds * 1000.0, bestSeconds[(int)SOTStage::Matching] * 1000.0,
+			double(capture.numPixels) * 2.0 / std::max(currentSortSeconds + targetSortSeconds, 1e-12) / 1e6);
+	}
+	printf("\n");
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	_mkdir("out");
+
+	// SOTImageColors --benchmark [file.json] runs the benchmarks instead. --benchmark-large also runs a much bigger image.
+	if (argc > 1 && (strcmp(argv[1], "--benchmark") == 0 || strcmp(argv[1], "--benchmark-large") == 0))
+		return RunBenchmark(argc > 2 ? argv[2] : c_benchmarkFileName, strcmp(argv[1], "--benchmark-large") == 0) ? 0 : 1;
+
+	// SOTImageColors --replay-projections file.proj... replays projections captured with PROJECTION_CAPTURE() instead
+	if (argc > 1 && strcmp(argv[1], "--replay-projections") == 0)
+	{
+		#if !STAGE_TIMING() && !TRACING()
+		printf("Warning: --replay-projections needs STAGE_TIMING() to time the sorts\n");
+		#endif
+		bool ret = argc > 2;
+		for (int argIndex = 2; argIndex < argc; ++argIndex)
+			ret &= ReplayProjections(argv[argIndex]);
+		return ret ? 0 : 1;
+	}
+
+	#if TRANSPORT_CACHE()
+	_mkdir(c_transportCacheDir);
+	#endif
+
+	#if PERF_COUNTERS()
+	PerfCounterValues perfCounters;
+	if (!ReadPerfCounters(perfCounters))
+		printf("Warning: hardware counters are not available, so they will all be 0\n");
+	#endif
+
+	// Load the images in parallel. Only the source is float, the targets of the optimal transport stay uint8.
+	ImageData srcImage;
+	ImageDataU8 imageDunes;
+	ImageDataU8 imageTurtle;
+	ImageDataU8 imageBigCat;
+	{
+		std::vector<ImageLoadJob> jobs(4);
+		jobs[0].fileName = "images/florida.png";
+		jobs[0].floatImage = &srcImage;
+		jobs[1].fileName = "images/dunes.png";
+		jobs[1].u8Image = &imageDunes;
+		jobs[2].fileName = "images/turtle.png";
+		jobs[2].u8Image = &imageTurtle;
+		jobs[3].fileName = "images/bigcat.png";
+		jobs[3].u8Image = &imageBigCat;
+
+		if (!LoadImages(jobs))
+			return 1;
+	}
+
+	#if HISTOGRAMS()
+	{
+		std::vector<unsigned char> srcPixels(srcImage.pixels.size());
+		ConvertFloatToU8(srcPixels.data(), srcImage.pixels.data(), srcPixels.size());
+		WriteImageHistogram(srcPixels.data(), srcPixels.size() / 3, "out/florida.histogram.png");
+		WriteImageHistogram(imageDunes.pixels.data(), imageDunes.pixels.size() / 3, "out/dunes.histogram.png");
+		WriteImageHistogram(imageTurtle.pixels.data(), imageTurtle.pixels.size() / 3, "out/turtle.histogram.png");
+		WriteImageHistogram(imageBigCat.pixels.data(), imageBigCat.pixels.size() / 3, "out/bigcat.histogram.png");
+	}
+	#endif
+
+	// Calculate optimal transport from the source image to the other images, or get it from the cache.
+	// The solves share a workspace so the working memory is only allocated once.
+	SOTWorkspace workspace;
+
+	TransportResult OTDunes;
+	CachedSlicedOptimalTransport(srcImage, imageDunes, OTDunes, "out/dunes.csv", workspace);
+
+	TransportResult OTTurtle;
+	CachedSlicedOptimalTransport(srcImage, imageTurtle, OTTurtle, "out/turtle.csv", workspace);
+
+	TransportResult OTBigCat;
+	CachedSlicedOptimalTransport(srcImage, imageBigCat, OTBigCat, "out/bigcat.csv", workspace);
+
+	#if STORAGE_ACCURACY_REPORT()
+	ReportStorageAccuracy(srcImage, imageDunes, OTDunes, "out/dunes.csv", workspace);
+	ReportStorageAccuracy(srcImage, imageTurtle, OTTurtle, "out/turtle.csv", workspace);
+	ReportStorageAccuracy(srcImage, imageBigCat, OTBigCat, "out/bigcat.csv", workspace);
+	#endif
+
+	#if JOINT_HISTOGRAMS()
+	SaveJointHistogram(srcImage.pixels.data(), srcImage.pixels.size() / 3, "out/florida.jhist");
+	SaveJointHistogram(imageDunes.pixels.data(), imageDunes.pixels.size() / 3, "out/dunes.jhist");
+	SaveJointHistogram(imageTurtle.pixels.data(), imageTurtle.pixels.size() / 3, "out/turtle.jhist");
+	SaveJointHistogram(imageBigCat.pixels.data(), imageBigCat.pixels.size() / 3, "out/bigcat.jhist");
+	SaveJointHistogram(OTDunes.data(), OTDunes.size() / 3, "out/florida-dunes.jhist");
+	SaveJointHistogram(OTTurtle.data(), OTTurtle.size() / 3, "out/florida-turtle.jhist");
+	SaveJointHistogram(OTBigCat.data(), OTBigCat.size() / 3, "out/florida-bigcat.jhist");
+	#endif
+
+	#if DISPLACEMENT_FIELDS()
+	SaveDisplacementField(srcImage, OTDunes, "out/dunes.sotd");
+	SaveDisplacementField(srcImage, OTTurtle, "out/turtle.sotd");
+	SaveDisplacementField(srcImage, OTBigCat, "out/bigcat.sotd");
+
+	// Interpolate from the files, rather than from the results in memory
+	{
+		DisplacementFieldReader fieldDunes, fieldTurtle;
+		if (fieldDunes.Open("out/dunes.sotd") && fieldTurtle.Open("out/turtle.sotd"))
+		{
+			InterpolateColorHistogram1D(srcImage, fieldDunes, 1.0f, "out/florida-dunes.sotd.png");
+			InterpolateColorHistogram2D(srcImage, fieldTurtle, 0.33f, fieldDunes, 0.33f, "out/florida-turtle_33_dunes_33.sotd.png");
+		}
+	}
+	#endif
+
+	// Make results, all in one pass over the images. They are streamed to their files, or written on other threads.
+	// The targets are in this order so the 2d interpolations add turtle before dunes.
+	std::vector<const TransportResult*> targets = { &OTTurtle, &OTDunes, &OTBigCat };
+	std::vector<InterpolationJob> jobs;
+	jobs.push_back({ { 0.0f, 1.0f, 0.0f }, "out/florida-dunes.png" });
+	jobs.push_back({ { 1.0f, 0.0f, 0.0f }, "out/florida-turtle.png" });
+	jobs.push_back({ { 0.0f, 0.0f, 1.0f }, "out/florida-bigcat.png" });
+
+	// Do 1d barycentric interpolation towards bigcat
+	for (int i = 0; i < 3; ++i)
+	{
+		float alpha = float(i + 1) / 4;
+		int percent = int(alpha * 100.0f);
+		char fileName[1024];
+		sprintf_s(fileName, "out/florida-bigcat_%i.png", percent);
+		jobs.push_back({ { 0.0f, 0.0f, alpha }, fileName });
+	}
+
+	// Do 2d barycentric interpolation towards turtle and dunes
+	jobs.push_back({ { 0.0f, 0.33f, 0.0f }, "out/florida-turtle_0_dunes_33.png" });
+	jobs.push_back({ { 0.0f, 0.66f, 0.0f }, "out/florida-turtle_0_dunes_66.png" });
+	jobs.push_back({ { 0.33f, 0.0f, 0.0f }, "out/florida-turtle_33_dunes_0.png" });
+	jobs.push_back({ { 0.66f, 0.0f, 0.0f }, "out/florida-turtle_66_dunes_0.png" });
+	jobs.push_back({ { 0.33f, 0.66f, 0.0f }, "out/florida-turtle_33_dunes_66.png" });
+	jobs.push_back({ { 0.66f, 0.33f, 0.0f }, "out/florida-turtle_66_dunes_33.png" });
+	jobs.push_back({ { 0.33f, 0.33f, 0.0f }, "out/florida-turtle_33_dunes_33.png" });
+
+	// Plot the color histograms of the outputs, next to them
+	#if HISTOGRAMS()
+	for (InterpolationJob& job : jobs)
+	{
+		const size_t extension = job.fileName.rfind('.');
+		job.histogramFileName = job.fileName.substr(0, extension) + ".histogram.png";
+	}
+	#endif
+
+	#if PREVIEW_TIMING_REPORT()
+	ReportPreviewTiming(srcImage, targets, { 0.33f, 0.33f, 0.0f });
+	#endif
+
+	#if STREAM_OUTPUT_IMAGES()
+	if (!InterpolateColorHistogramBatchStreamed(srcImage, targets, jobs))
+		return 1;
+	#else
+	AsyncImageWriter writer;
+	#if INTERPOLATE_SEPARATELY()
+	bool interpolated = InterpolateColorHistogramSeparately(srcImage, targets, jobs, &writer);
+	#else
+	bool interpolated = InterpolateColorHistogramBatch(srcImage, targets, jobs, &writer);
+	#endif
+
+	// Wait for the images to finish being written
+	if (!writer.Flush() || !interpolated)
+		return 1;
+	#endif
+
+	#if WEIGHT_MAP_OUTPUTS()
+	if (!WriteWeightMapOutputs(srcImage, OTTurtle, OTDunes, OTBigCat))
+		return 1;
+	#endif
+
+	#if TRACING()
+	if (!WriteTrace(c_traceFileName))
+		printf("could not write %s\n", c_traceFileName);
+	#endif
 
 	return 0;
 }
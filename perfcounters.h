@@ -0,0 +1,158 @@
+#pragma once
+
+// Hardware performance counters of the calling thread: cycles, instructions, last level cache misses and dTLB misses.
+// They use perf_event_open on Linux. Elsewhere, or if the kernel doesn't allow it, the counters read as 0.
+// Each thread opens its own counters the first time it reads them, and they only count that thread, in user mode.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace PerfCounters
+{
+	enum Counter
+	{
+		Cycles,
+		Instructions,
+		LLCMisses,
+		DTLBMisses,
+		Count
+	};
+}
+
+inline const char* PerfCounterName(int counter)
+{
+	switch (counter)
+	{
+		case PerfCounters::Cycles: return "Cycles";
+		case PerfCounters::Instructions: return "Instructions";
+		case PerfCounters::LLCMisses: return "LLC Misses";
+		case PerfCounters::DTLBMisses: return "dTLB Misses";
+	}
+	return "unknown";
+}
+
+struct PerfCounterValues
+{
+	void Add(const PerfCounterValues& other)
+	{
+		for (int counter = 0; counter < PerfCounters::Count; ++counter)
+			values[counter] += other.values[counter];
+	}
+
+	// Adds end - begin
+	void AddDifference(const PerfCounterValues& end, const PerfCounterValues& begin)
+	{
+		for (int counter = 0; counter < PerfCounters::Count; ++counter)
+			values[counter] += end.values[counter] - begin.values[counter];
+	}
+
+	uint64_t values[PerfCounters::Count] = {};
+};
+
+namespace PerfCounters
+{
+	#ifdef __linux__
+	// The counters are one group, so they are read together with one read(). Counters the CPU doesn't have are left out.
+	struct ThreadCounters
+	{
+		ThreadCounters()
+		{
+			const uint32_t types[Count] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+			const uint64_t configs[Count] = {
+				PERF_COUNT_HW_CPU_CYCLES,
+				PERF_COUNT_HW_INSTRUCTIONS,
+				PERF_COUNT_HW_CACHE_MISSES,
+				PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+			};
+
+			for (int counter = 0; counter < Count; ++counter)
+			{
+				perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = types[counter];
+				attr.config = configs[counter];
+				attr.disabled = (leader < 0) ? 1 : 0;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_GROUP;
+
+				int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+				if (fd < 0)
+					continue;
+				if (leader < 0)
+					leader = fd;
+				fds[numOpen] = fd;
+				counters[numOpen] = counter;
+				numOpen++;
+			}
+
+			if (leader >= 0)
+			{
+				ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+				ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			}
+		}
+
+		~ThreadCounters()
+		{
+			for (int index = 0; index < numOpen; ++index)
+				close(fds[index]);
+		}
+
+		bool Read(PerfCounterValues& values) const
+		{
+			values = PerfCounterValues();
+			if (leader < 0)
+				return false;
+
+			uint64_t data[1 + Count];
+			if (read(leader, data, sizeof(data)) < ssize_t(sizeof(uint64_t)))
+				return false;
+			for (uint64_t index = 0; index < data[0] && index < uint64_t(numOpen); ++index)
+				values.values[counters[index]] = data[1 + index];
+			return true;
+		}
+
+		int leader = -1;
+		int fds[Count] = {};
+		int counters[Count] = {};    // which counter each opened fd is, in the order they are read
+		int numOpen = 0;
+	};
+	#endif
+}
+
+// Reads the calling thread's counters. Returns false, with the values all 0, if there are no counters.
+inline bool ReadPerfCounters(PerfCounterValues& values)
+{
+	#ifdef __linux__
+	thread_local PerfCounters::ThreadCounters counters;
+	return counters.Read(values);
+	#else
+	values = PerfCounterValues();
+	return false;
+	#endif
+}
+
+// Reads the counters of every OpenMP thread, added together. Call it outside of parallel regions.
+// The threads stay the same between parallel regions, so the difference of two reads is what all of them did in between.
+inline PerfCounterValues ReadPerfCountersAllThreads()
+{
+	PerfCounterValues total;
+	#pragma omp parallel
+	{
+		PerfCounterValues values;
+		ReadPerfCounters(values);
+		#pragma omp critical
+		total.Add(values);
+	}
+	return total;
+}
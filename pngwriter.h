@@ -0,0 +1,562 @@
+#pragma once
+
+// A PNG writer which compresses with DEFLATE on multiple threads, like pigz does.
+// The filtered scanlines are split into chunks which are compressed independently and in parallel.
+// Each chunk uses the last 32KB of the chunk before it as a preset dictionary, and ends byte aligned with
+// an empty stored block (a zlib "sync flush"), so the chunks concatenate into a single valid zlib stream.
+// Blocks use the fixed Huffman codes, like stb_image_write does.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+enum class PNGFilter
+{
+	None,
+	Sub,
+	Up,
+	Average,
+	Paeth,
+	Adaptive  // choose the filter per scanline which gives the smallest sum of absolute values
+};
+
+struct PNGWriteOptions
+{
+	PNGFilter filter = PNGFilter::Adaptive;
+	int compressionLevel = 6;            // 0 is uncompressed, 1 is fastest, 9 is smallest
+	size_t chunkSize = 256 * 1024;       // how many bytes of filtered scanlines each thread compresses at a time
+	int numThreads = 0;                  // how many threads WritePNGParallel uses. 0 means as many as OpenMP would.
+};
+
+namespace PNGWriter
+{
+	static const int c_windowSize = 32768;
+	static const int c_minMatch = 3;
+	static const int c_maxMatch = 258;
+	static const int c_hashBits = 15;
+
+	inline uint32_t CRC32(uint32_t crc, const unsigned char* data, size_t size)
+	{
+		static uint32_t s_table[256] = {};
+		static bool s_tableMade = []()
+		{
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t c = i;
+				for (int bit = 0; bit < 8; ++bit)
+					c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+				s_table[i] = c;
+			}
+			return true;
+		}();
+		(void)s_tableMade;
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = s_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline uint32_t Adler32(const unsigned char* data, size_t size)
+	{
+		static const uint32_t c_base = 65521;
+		static const size_t c_blockSize = 5552; // the most bytes that can be summed before a modulus is needed
+
+		uint32_t a = 1;
+		uint32_t b = 0;
+		while (size > 0)
+		{
+			size_t blockSize = std::min(size, c_blockSize);
+			for (size_t i = 0; i < blockSize; ++i)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= c_base;
+			b %= c_base;
+			data += blockSize;
+			size -= blockSize;
+		}
+		return (b << 16) | a;
+	}
+
+	// Combines the adler32 of two pieces of data into the adler32 of both, given the size of the second piece. From zlib.
+	inline uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+	{
+		static const uint32_t c_base = 65521;
+
+		uint32_t remainder = uint32_t(size2 % c_base);
+		uint32_t sum1 = adler1 & 0xFFFF;
+		uint32_t sum2 = uint32_t((uint64_t(remainder) * sum1) % c_base);
+		sum1 += (adler2 & 0xFFFF) + c_base - 1;
+		sum2 += (adler1 >> 16) + (adler2 >> 16) + c_base - remainder;
+		if (sum1 >= c_base) sum1 -= c_base;
+		if (sum1 >= c_base) sum1 -= c_base;
+		if (sum2 >= (c_base << 1)) sum2 -= (c_base << 1);
+		if (sum2 >= c_base) sum2 -= c_base;
+		return sum1 | (sum2 << 16);
+	}
+
+	// Writes bits least significant bit first, as DEFLATE wants
+	struct BitWriter
+	{
+		void Write(uint32_t bits, int count)
+		{
+			bitBuffer |= uint64_t(bits) << bitCount;
+			bitCount += count;
+			while (bitCount >= 8)
+			{
+				bytes.push_back((unsigned char)(bitBuffer & 0xFF));
+				bitBuffer >>= 8;
+				bitCount -= 8;
+			}
+		}
+
+		// Huffman codes are defined most significant bit first, so they are reversed
+		void WriteCode(uint32_t code, int count)
+		{
+			uint32_t reversed = 0;
+			for (int i = 0; i < count; ++i)
+				reversed |= ((code >> i) & 1) << (count - 1 - i);
+			Write(reversed, count);
+		}
+
+		void AlignToByte()
+		{
+			if (bitCount > 0)
+				Write(0, 8 - bitCount);
+		}
+
+		std::vector<unsigned char> bytes;
+		uint64_t bitBuffer = 0;
+		int bitCount = 0;
+	};
+
+	inline void WriteFixedLiteral(BitWriter& writer, int symbol)
+	{
+		if (symbol <= 143)
+			writer.WriteCode(0x30 + symbol, 8);
+		else if (symbol <= 255)
+			writer.WriteCode(0x190 + symbol - 144, 9);
+		else if (symbol <= 279)
+			writer.WriteCode(symbol - 256, 7);
+		else
+			writer.WriteCode(0xC0 + symbol - 280, 8);
+	}
+
+	inline void WriteMatch(BitWriter& writer, int length, int distance)
+	{
+		static const int c_lengthBase[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+		static const int c_lengthExtra[] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+		static const int c_distanceBase[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+		static const int c_distanceExtra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+		int lengthCode = 0;
+		while (lengthCode < 28 && c_lengthBase[lengthCode + 1] <= length)
+			lengthCode++;
+		WriteFixedLiteral(writer, 257 + lengthCode);
+		writer.Write(length - c_lengthBase[lengthCode], c_lengthExtra[lengthCode]);
+
+		int distanceCode = 0;
+		while (distanceCode < 29 && c_distanceBase[distanceCode + 1] <= distance)
+			distanceCode++;
+		writer.WriteCode(distanceCode, 5);
+		writer.Write(distance - c_distanceBase[distanceCode], c_distanceExtra[distanceCode]);
+	}
+
+	inline uint32_t Hash3(const unsigned char* data)
+	{
+		uint32_t value = uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16);
+		return (value * 2654435761u) >> (32 - c_hashBits);
+	}
+
+	// Compresses data[begin, end) into raw DEFLATE. Matches may reach back into data before begin, up to the window size.
+	// A final chunk ends the stream. Other chunks end with a sync flush, so they end byte aligned.
+	inline std::vector<unsigned char> DeflateChunk(const unsigned char* data, size_t begin, size_t end, bool finalChunk, int level)
+	{
+		BitWriter writer;
+
+		// Level 0 is stored blocks, which are always byte aligned
+		if (level <= 0)
+		{
+			size_t pos = begin;
+			do
+			{
+				size_t blockSize = std::min<size_t>(end - pos, 65535);
+				bool finalBlock = finalChunk && (pos + blockSize == end);
+				writer.Write(finalBlock ? 1 : 0, 1);
+				writer.Write(0, 2);
+				writer.AlignToByte();
+				writer.Write(uint32_t(blockSize), 16);
+				writer.Write(uint32_t(~blockSize) & 0xFFFF, 16);
+				writer.bytes.insert(writer.bytes.end(), &data[pos], &data[pos + blockSize]);
+				pos += blockSize;
+			}
+			while (pos < end);
+			return writer.bytes;
+		}
+
+		static const int c_maxChainLengths[] = { 0, 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+		const int maxChainLength = c_maxChainLengths[std::min(level, 9)];
+
+		std::vector<int64_t> head(size_t(1) << c_hashBits, -1);
+		std::vector<int64_t> prev(c_windowSize, -1);
+		auto Insert = [&](size_t pos)
+		{
+			uint32_t hash = Hash3(&data[pos]);
+			prev[pos & (c_windowSize - 1)] = head[hash];
+			head[hash] = int64_t(pos);
+		};
+
+		// Prime the hash chains with the preset dictionary
+		const size_t dictionaryBegin = (begin > c_windowSize) ? begin - c_windowSize : 0;
+		for (size_t pos = dictionaryBegin; pos + c_minMatch <= begin; ++pos)
+			Insert(pos);
+
+		writer.Write(finalChunk ? 1 : 0, 1);
+		writer.Write(1, 2); // fixed Huffman codes
+
+		size_t pos = begin;
+		while (pos < end)
+		{
+			int bestLength = 0;
+			size_t bestDistance = 0;
+			if (pos + c_minMatch <= end)
+			{
+				const int maxLength = int(std::min<size_t>(c_maxMatch, end - pos));
+				int64_t candidate = head[Hash3(&data[pos])];
+				for (int chain = 0; chain < maxChainLength && candidate >= 0 && pos - size_t(candidate) <= c_windowSize; ++chain)
+				{
+					const unsigned char* a = &data[pos];
+					const unsigned char* b = &data[candidate];
+					int length = 0;
+					while (length < maxLength && a[length] == b[length])
+						length++;
+					if (length > bestLength)
+					{
+						bestLength = length;
+						bestDistance = pos - size_t(candidate);
+						if (length == maxLength)
+							break;
+					}
+
+					// The chain entries get reused as the window slides, so stop if the chain doesn't go backwards
+					int64_t next = prev[size_t(candidate) & (c_windowSize - 1)];
+					if (next >= candidate)
+						break;
+					candidate = next;
+				}
+			}
+
+			if (bestLength >= c_minMatch)
+			{
+				WriteMatch(writer, bestLength, int(bestDistance));
+				for (int i = 0; i < bestLength; ++i, ++pos)
+				{
+					if (pos + c_minMatch <= end)
+						Insert(pos);
+				}
+			}
+			else
+			{
+				WriteFixedLiteral(writer, data[pos]);
+				if (pos + c_minMatch <= end)
+					Insert(pos);
+				pos++;
+			}
+		}
+
+		// end of block
+		WriteFixedLiteral(writer, 256);
+
+		// sync flush: an empty stored block, which byte aligns the stream
+		if (!finalChunk)
+		{
+			writer.Write(0, 3);
+			writer.AlignToByte();
+			writer.Write(0x0000, 16);
+			writer.Write(0xFFFF, 16);
+		}
+		writer.AlignToByte();
+		return writer.bytes;
+	}
+
+	inline unsigned char Paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return (unsigned char)a;
+		if (pb <= pc)
+			return (unsigned char)b;
+		return (unsigned char)c;
+	}
+
+	// Filters a scanline into dest, which is the filter type byte followed by the filtered bytes
+	inline void FilterRow(unsigned char* dest, const unsigned char* row, const unsigned char* previousRow, int rowBytes, int bytesPerPixel, PNGFilter filter)
+	{
+		dest[0] = (unsigned char)filter;
+		unsigned char* out = &dest[1];
+		for (int i = 0; i < rowBytes; ++i)
+		{
+			int left = (i >= bytesPerPixel) ? row[i - bytesPerPixel] : 0;
+			int up = previousRow ? previousRow[i] : 0;
+			int upLeft = (previousRow && i >= bytesPerPixel) ? previousRow[i - bytesPerPixel] : 0;
+			switch (filter)
+			{
+				case PNGFilter::None: out[i] = row[i]; break;
+				case PNGFilter::Sub: out[i] = (unsigned char)(row[i] - left); break;
+				case PNGFilter::Up: out[i] = (unsigned char)(row[i] - up); break;
+				case PNGFilter::Average: out[i] = (unsigned char)(row[i] - ((left + up) >> 1)); break;
+				case PNGFilter::Paeth: out[i] = (unsigned char)(row[i] - Paeth(left, up, upLeft)); break;
+				case PNGFilter::Adaptive: break;
+			}
+		}
+	}
+
+	// Filters a scanline with options.filter. Adaptive uses the filter with the smallest sum of the filtered bytes as
+	// signed values, and needs a candidate buffer of rowBytes + 1 bytes to try them in.
+	inline void FilterRowWithOptions(unsigned char* dest, const unsigned char* row, const unsigned char* previousRow, int rowBytes, int bytesPerPixel, PNGFilter filter, unsigned char* candidate)
+	{
+		if (filter != PNGFilter::Adaptive)
+		{
+			FilterRow(dest, row, previousRow, rowBytes, bytesPerPixel, filter);
+			return;
+		}
+
+		uint64_t bestScore = ~uint64_t(0);
+		for (PNGFilter candidateFilter : { PNGFilter::None, PNGFilter::Sub, PNGFilter::Up, PNGFilter::Average, PNGFilter::Paeth })
+		{
+			FilterRow(candidate, row, previousRow, rowBytes, bytesPerPixel, candidateFilter);
+			uint64_t score = 0;
+			for (int i = 1; i <= rowBytes; ++i)
+				score += abs((signed char)candidate[i]);
+			if (score < bestScore)
+			{
+				bestScore = score;
+				memcpy(dest, candidate, size_t(rowBytes) + 1);
+			}
+		}
+	}
+
+	inline void WritePNGChunk(FILE* file, const char type[4], const unsigned char* data, size_t size)
+	{
+		unsigned char header[8] = {
+			(unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+			(unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3]
+		};
+		uint32_t crc = CRC32(0, &header[4], 4);
+		crc = CRC32(crc, data, size);
+		unsigned char footer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+
+		fwrite(header, 1, 8, file);
+		if (size > 0)
+			fwrite(data, 1, size, file);
+		fwrite(footer, 1, 4, file);
+	}
+
+	// Writes the signature and the IHDR chunk
+	inline void WritePNGHeader(FILE* file, int width, int height, int channels)
+	{
+		static const unsigned char c_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		fwrite(c_signature, 1, 8, file);
+
+		static const unsigned char c_colorTypes[5] = { 0, 0, 4, 2, 6 };
+		unsigned char header[13] = {
+			(unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+			(unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+			8, c_colorTypes[channels], 0, 0, 0
+		};
+		WritePNGChunk(file, "IHDR", header, sizeof(header));
+	}
+}
+
+// Writes 8 bit per channel pixels as a PNG, compressing the chunks in parallel
+inline bool WritePNGParallel(const char* fileName, int width, int height, int channels, const unsigned char* pixels, const PNGWriteOptions& options = PNGWriteOptions())
+{
+	using namespace PNGWriter;
+
+	// Filter the scanlines in parallel
+	const int rowBytes = width * channels;
+	const size_t filteredRowBytes = size_t(rowBytes) + 1;
+	std::vector<unsigned char> filtered(filteredRowBytes * height);
+	const int numThreads = (options.numThreads > 0) ? options.numThreads : omp_get_max_threads();
+
+	#pragma omp parallel for num_threads(numThreads)
+	for (int y = 0; y < height; ++y)
+	{
+		const unsigned char* row = &pixels[size_t(y) * rowBytes];
+		const unsigned char* previousRow = (y > 0) ? &pixels[size_t(y - 1) * rowBytes] : nullptr;
+		unsigned char* dest = &filtered[size_t(y) * filteredRowBytes];
+		std::vector<unsigned char> candidate((options.filter == PNGFilter::Adaptive) ? filteredRowBytes : 0);
+		FilterRowWithOptions(dest, row, previousRow, rowBytes, channels, options.filter, candidate.data());
+	}
+
+	// Deflate the chunks in parallel, and get their adler32s
+	const size_t chunkSize = std::max<size_t>(options.chunkSize, c_windowSize);
+	const int numChunks = int((filtered.size() + chunkSize - 1) / chunkSize);
+	std::vector<std::vector<unsigned char>> compressedChunks(numChunks);
+	std::vector<uint32_t> chunkAdlers(numChunks);
+
+	#pragma omp parallel for schedule(dynamic) num_threads(numThreads)
+	for (int chunkIndex = 0; chunkIndex < numChunks; ++chunkIndex)
+	{
+		const size_t begin = size_t(chunkIndex) * chunkSize;
+		const size_t end = std::min(begin + chunkSize, filtered.size());
+		compressedChunks[chunkIndex] = DeflateChunk(filtered.data(), begin, end, chunkIndex == numChunks - 1, options.compressionLevel);
+		chunkAdlers[chunkIndex] = Adler32(&filtered[begin], end - begin);
+	}
+
+	// Stitch together the zlib stream
+	uint32_t adler = 1;
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	for (int chunkIndex = 0; chunkIndex < numChunks; ++chunkIndex)
+	{
+		const size_t begin = size_t(chunkIndex) * chunkSize;
+		const size_t end = std::min(begin + chunkSize, filtered.size());
+		adler = Adler32Combine(adler, chunkAdlers[chunkIndex], end - begin);
+		zlib.insert(zlib.end(), compressedChunks[chunkIndex].begin(), compressedChunks[chunkIndex].end());
+		std::vector<unsigned char>().swap(compressedChunks[chunkIndex]);
+	}
+	zlib.push_back((unsigned char)(adler >> 24));
+	zlib.push_back((unsigned char)(adler >> 16));
+	zlib.push_back((unsigned char)(adler >> 8));
+	zlib.push_back((unsigned char)adler);
+
+	// Write the file
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	WritePNGHeader(file, width, height, channels);
+	WritePNGChunk(file, "IDAT", zlib.data(), zlib.size());
+	WritePNGChunk(file, "IEND", nullptr, 0);
+
+	bool ret = (ferror(file) == 0);
+	fclose(file);
+	return ret;
+}
+
+// Writes a PNG a few rows at a time, so the whole image never needs to be in memory.
+// Filtered rows are compressed a chunk at a time, into their own IDAT chunks, using the same chunks and dictionaries
+// as WritePNGParallel, so the compressed data is the same. The chunks are compressed on the calling thread.
+struct PNGStreamWriter
+{
+	PNGStreamWriter() = default;
+	PNGStreamWriter(const PNGStreamWriter&) = delete;
+	PNGStreamWriter& operator=(const PNGStreamWriter&) = delete;
+
+	~PNGStreamWriter()
+	{
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool Open(const char* fileName, int width, int height, int channels, const PNGWriteOptions& options = PNGWriteOptions())
+	{
+		fopen_s(&m_file, fileName, "wb");
+		if (!m_file)
+			return false;
+
+		m_width = width;
+		m_height = height;
+		m_channels = channels;
+		m_options = options;
+		m_chunkSize = std::max<size_t>(options.chunkSize, PNGWriter::c_windowSize);
+		m_rowsWritten = 0;
+		m_dictionarySize = 0;
+		m_adler = 1;
+		m_firstIDAT = true;
+		m_previousRow.clear();
+		m_candidate.resize((options.filter == PNGFilter::Adaptive) ? size_t(width) * channels + 1 : 0);
+
+		PNGWriter::WritePNGHeader(m_file, width, height, channels);
+		return ferror(m_file) == 0;
+	}
+
+	// Adds rows of pixels, which are width * channels bytes each
+	bool WriteRows(const unsigned char* rows, int numRows)
+	{
+		using namespace PNGWriter;
+
+		const int rowBytes = m_width * m_channels;
+		const size_t filteredRowBytes = size_t(rowBytes) + 1;
+		for (int y = 0; y < numRows && m_rowsWritten < m_height; ++y, ++m_rowsWritten)
+		{
+			const unsigned char* row = &rows[size_t(y) * rowBytes];
+			const size_t offset = m_filtered.size();
+			m_filtered.resize(offset + filteredRowBytes);
+			FilterRowWithOptions(&m_filtered[offset], row, m_previousRow.empty() ? nullptr : m_previousRow.data(), rowBytes, m_channels, m_options.filter, m_candidate.data());
+			m_previousRow.assign(row, row + rowBytes);
+
+			while (m_filtered.size() - m_dictionarySize >= m_chunkSize)
+				CompressChunk(m_chunkSize, false);
+		}
+		return ferror(m_file) == 0;
+	}
+
+	// Compresses what is left, and finishes the file
+	bool Close()
+	{
+		if (!m_file)
+			return false;
+
+		CompressChunk(m_filtered.size() - m_dictionarySize, true);
+		PNGWriter::WritePNGChunk(m_file, "IEND", nullptr, 0);
+
+		bool ret = (m_rowsWritten == m_height) && (ferror(m_file) == 0);
+		ret &= (fclose(m_file) == 0);
+		m_file = nullptr;
+		return ret;
+	}
+
+	// Compresses the next chunk of filtered bytes into an IDAT chunk, and keeps the last window of them as the next dictionary
+	void CompressChunk(size_t size, bool finalChunk)
+	{
+		using namespace PNGWriter;
+
+		std::vector<unsigned char> compressed;
+		if (m_firstIDAT)
+			compressed = { 0x78, 0x01 };
+		m_firstIDAT = false;
+
+		std::vector<unsigned char> chunk = DeflateChunk(m_filtered.data(), m_dictionarySize, m_dictionarySize + size, finalChunk, m_options.compressionLevel);
+		compressed.insert(compressed.end(), chunk.begin(), chunk.end());
+		m_adler = Adler32Combine(m_adler, Adler32(&m_filtered[m_dictionarySize], size), size);
+		if (finalChunk)
+		{
+			compressed.push_back((unsigned char)(m_adler >> 24));
+			compressed.push_back((unsigned char)(m_adler >> 16));
+			compressed.push_back((unsigned char)(m_adler >> 8));
+			compressed.push_back((unsigned char)m_adler);
+		}
+		WritePNGChunk(m_file, "IDAT", compressed.data(), compressed.size());
+
+		const size_t end = m_dictionarySize + size;
+		const size_t keep = std::min<size_t>(end, c_windowSize);
+		m_filtered.erase(m_filtered.begin(), m_filtered.begin() + (end - keep));
+		m_dictionarySize = keep;
+	}
+
+	FILE* m_file = nullptr;
+	int m_width = 0;
+	int m_height = 0;
+	int m_channels = 0;
+	PNGWriteOptions m_options;
+	size_t m_chunkSize = 0;
+	int m_rowsWritten = 0;
+
+	std::vector<unsigned char> m_filtered;   // the dictionary, followed by filtered bytes which are not compressed yet
+	size_t m_dictionarySize = 0;
+	uint32_t m_adler = 1;
+	bool m_firstIDAT = true;
+	std::vector<unsigned char> m_previousRow;
+	std::vector<unsigned char> m_candidate;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+// Captured projections of one batch of a sliced optimal transport solve, so the sorts and matching can be replayed
+// on the values a real image makes, which have many more ties and clusters than uniform random floats.
+// The projections are stored as they were in the solver's working memory, in pixel order, 2 or 4 bytes each.
+// A file is a small header followed by the current projections and then the target projections.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+struct ProjectionCapture
+{
+	uint32_t storage = 0;         // the SOTStorage of the solve
+	uint32_t elementBytes = 0;    // bytes per projection
+	uint32_t numPixels = 0;
+	uint32_t iteration = 0;
+	uint32_t batchIndex = 0;
+	float direction[3] = {};
+	std::vector<unsigned char> currentProjections;
+	std::vector<unsigned char> targetProjections;
+};
+
+namespace ProjectionCaptureDetail
+{
+	static const char c_magic[8] = { 'S', 'O', 'T', 'P', 'R', 'O', 'J', '1' };
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t storage;
+		uint32_t elementBytes;
+		uint32_t numPixels;
+		uint32_t iteration;
+		uint32_t batchIndex;
+		float direction[3];
+	};
+}
+
+inline bool WriteProjectionCapture(const char* fileName, const ProjectionCapture& capture)
+{
+	using namespace ProjectionCaptureDetail;
+
+	Header header;
+	memcpy(header.magic, c_magic, sizeof(c_magic));
+	header.storage = capture.storage;
+	header.elementBytes = capture.elementBytes;
+	header.numPixels = capture.numPixels;
+	header.iteration = capture.iteration;
+	header.batchIndex = capture.batchIndex;
+	memcpy(header.direction, capture.direction, sizeof(header.direction));
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+	bool ret = fwrite(&header, sizeof(header), 1, file) == 1;
+	ret &= fwrite(capture.currentProjections.data(), 1, capture.currentProjections.size(), file) == capture.currentProjections.size();
+	ret &= fwrite(capture.targetProjections.data(), 1, capture.targetProjections.size(), file) == capture.targetProjections.size();
+	ret &= fclose(file) == 0;
+	return ret;
+}
+
+inline bool ReadProjectionCapture(const char* fileName, ProjectionCapture& capture)
+{
+	using namespace ProjectionCaptureDetail;
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "rb");
+	if (!file)
+		return false;
+
+	Header header;
+	bool ret = fread(&header, sizeof(header), 1, file) == 1;
+	ret = ret && memcmp(header.magic, c_magic, sizeof(c_magic)) == 0 && (header.elementBytes == 2 || header.elementBytes == 4);
+	if (ret)
+	{
+		capture.storage = header.storage;
+		capture.elementBytes = header.elementBytes;
+		capture.numPixels = header.numPixels;
+		capture.iteration = header.iteration;
+		capture.batchIndex = header.batchIndex;
+		memcpy(capture.direction, header.direction, sizeof(capture.direction));
+
+		const size_t arrayBytes = size_t(header.numPixels) * header.elementBytes;
+		capture.currentProjections.resize(arrayBytes);
+		capture.targetProjections.resize(arrayBytes);
+		ret = fread(capture.currentProjections.data(), 1, arrayBytes, file) == arrayBytes;
+		ret = ret && fread(capture.targetProjections.data(), 1, arrayBytes, file) == arrayBytes;
+	}
+	fclose(file);
+	return ret;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+// A roofline report: how close each stage of a computation gets to the memory bandwidth and floating point limits
+// of the machine. The bytes and FLOPs of each stage are worked out by the caller from the sizes of the data.
+// The limits are measured once per machine, with a STREAM style triad for the bandwidth, and independent FMA chains
+// for the FLOPs, and saved to a file so later runs don't need to measure them again.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+#include <omp.h>
+
+struct MachineRoof
+{
+	double bandwidthGBs = 0.0;   // main memory bandwidth, from the triad
+	double gflops = 0.0;         // fp32 FMA throughput of all threads
+};
+
+// One stage of a computation, with how much it moved and computed, and how long it took
+struct RooflineStage
+{
+	const char* name;
+	double bytes;
+	double flops;
+	double seconds;
+};
+
+namespace Roofline
+{
+	static const size_t c_triadElements = 16 * 1024 * 1024;   // 3 arrays of 128MB of doubles, so they are much bigger than the caches
+	static const int c_triadRuns = 5;
+	static const int c_fmaIterations = 100000000;
+
+	inline double Seconds(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// a = b + scalar * c, like STREAM's triad. It counts 24 bytes per element, which leaves out write allocate traffic.
+	inline double MeasureTriadBandwidth()
+	{
+		const int count = int(c_triadElements);
+		std::vector<double> a(c_triadElements), b(c_triadElements), c(c_triadElements);
+
+		// Touch the pages on the threads that will use them
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < count; ++i)
+		{
+			a[i] = 0.0;
+			b[i] = 1.0;
+			c[i] = 2.0;
+		}
+
+		const double scalar = 3.0;
+		double bestSeconds = 1e30;
+		for (int run = 0; run < c_triadRuns; ++run)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			#pragma omp parallel for schedule(static)
+			for (int i = 0; i < count; ++i)
+				a[i] = b[i] + scalar * c[i];
+			bestSeconds = std::min(bestSeconds, Seconds(start));
+		}
+
+		// Use the result so the loop isn't optimized away
+		if (a[count / 2] != 7.0)
+			printf("Warning: the bandwidth probe got a wrong result\n");
+
+		return 24.0 * double(c_triadElements) / bestSeconds / 1e9;
+	}
+
+	// Each thread runs 8 independent chains of 8 wide FMAs, which is enough to hide the FMA latency
+	inline double MeasureFMAGFlops()
+	{
+		double totalFlops = 0.0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		#pragma omp parallel reduction(+:totalFlops)
+		{
+			__m256 accumulators[8];
+			for (int chain = 0; chain < 8; ++chain)
+				accumulators[chain] = _mm256_set1_ps(float(chain + omp_get_thread_num()));
+			const __m256 multiplier = _mm256_set1_ps(0.999999f);
+			const __m256 addend = _mm256_set1_ps(0.000001f);
+			for (int iteration = 0; iteration < c_fmaIterations / 8; ++iteration)
+			{
+				for (int chain = 0; chain < 8; ++chain)
+					accumulators[chain] = _mm256_fmadd_ps(accumulators[chain], multiplier, addend);
+			}
+
+			float sum[8];
+			__m256 total = accumulators[0];
+			for (int chain = 1; chain < 8; ++chain)
+				total = _mm256_add_ps(total, accumulators[chain]);
+			_mm256_storeu_ps(sum, total);
+
+			// 2 FLOPs per lane per FMA. The sum is added in as 0 so the chains can't be optimized away.
+			totalFlops += double(c_fmaIterations) * 8.0 * 2.0 + double(sum[0] * 0.0f);
+		}
+		return totalFlops / Seconds(start) / 1e9;
+	}
+}
+
+// Loads the machine's limits from fileName, or measures them and saves them there
+inline MachineRoof GetMachineRoof(const char* fileName)
+{
+	MachineRoof roof;
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "rb");
+	if (file)
+	{
+		int numRead = fscanf(file, "%lf %lf", &roof.bandwidthGBs, &roof.gflops);
+		fclose(file);
+		if (numRead == 2 && roof.bandwidthGBs > 0.0 && roof.gflops > 0.0)
+			return roof;
+	}
+
+	printf("Measuring memory bandwidth and FLOPs...\n");
+	roof.bandwidthGBs = Roofline::MeasureTriadBandwidth();
+	roof.gflops = Roofline::MeasureFMAGFlops();
+	printf("%0.1f GB/s, %0.1f GFLOP/s\n", roof.bandwidthGBs, roof.gflops);
+
+	fopen_s(&file, fileName, "wb");
+	if (file)
+	{
+		fprintf(file, "%f %f\n", roof.bandwidthGBs, roof.gflops);
+		fclose(file);
+	}
+	else
+	{
+		printf("could not write %s\n", fileName);
+	}
+	return roof;
+}
+
+// Prints the achieved bandwidth and FLOPs of each stage, and what fraction they are of what the roofline allows.
+// A stage can do at most min(gflops, intensity * bandwidth) FLOPs per second, where intensity is its FLOPs per byte.
+// For a stage with no FLOPs, it's the fraction of the bandwidth.
+inline void PrintRoofline(const char* title, const std::vector<RooflineStage>& stages, const MachineRoof& roof)
+{
+	printf("%s, against %0.1f GB/s and %0.1f GFLOP/s:\n", title, roof.bandwidthGBs, roof.gflops);
+	printf("  %-14s %10s %10s %10s %10s %10s %10s\n", "Stage", "GB", "GFLOP", "FLOP/byte", "GB/s", "GFLOP/s", "of roof");
+	for (const RooflineStage& stage : stages)
+	{
+		const double seconds = std::max(stage.seconds, 1e-12);
+		const double gbs = stage.bytes / seconds / 1e9;
+		const double gflops = stage.flops / seconds / 1e9;
+		const double intensity = stage.flops / std::max(stage.bytes, 1.0);
+
+		double fraction = gbs / roof.bandwidthGBs;
+		if (stage.flops > 0.0)
+			fraction = gflops / std::min(roof.gflops, intensity * roof.bandwidthGBs);
+
+		printf("  %-14s %10.3f %10.3f %10.3f %10.2f %10.2f %9.1f%%\n", stage.name, stage.bytes / 1e9, stage.flops / 1e9, intensity, gbs, gflops, fraction * 100.0);
+	}
+}
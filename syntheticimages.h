@@ -0,0 +1,148 @@
+#pragma once
+
+// Deterministic synthetic RGB images of any size, for benchmarks.
+// The same kind, size and seed always make the same image, and a different seed makes a different image of the same kind,
+// so a seed can be used for the source and another for the target. Each pixel only depends on its position and the seed,
+// so the images are made in parallel.
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+enum class SyntheticImage
+{
+	Gradient,     // a smooth blend of 4 corner colors
+	Noise,        // every channel of every pixel random
+	Posterized,   // smooth shapes, in a palette of only a few colors, so there are many ties
+	TiledPhoto,   // a photo, repeated with mirroring to fill the image
+	Count
+};
+
+inline const char* SyntheticImageName(SyntheticImage kind)
+{
+	switch (kind)
+	{
+		case SyntheticImage::Gradient: return "gradient";
+		case SyntheticImage::Noise: return "noise";
+		case SyntheticImage::Posterized: return "posterized";
+		case SyntheticImage::TiledPhoto: return "tiled photo";
+		case SyntheticImage::Count: break;
+	}
+	return "unknown";
+}
+
+// A photo for SyntheticImage::TiledPhoto, as 3 channel uint8 pixels
+struct SyntheticPhoto
+{
+	const unsigned char* pixels = nullptr;
+	int width = 0;
+	int height = 0;
+};
+
+namespace Synthetic
+{
+	static const int c_paletteSize = 6;
+
+	// splitmix64, which turns a counter into well mixed random bits
+	inline uint64_t Hash(uint64_t value)
+	{
+		value += 0x9E3779B97F4A7C15ull;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		return value ^ (value >> 31);
+	}
+
+	inline unsigned char RandomByte(uint32_t seed, uint64_t index)
+	{
+		return (unsigned char)(Hash((uint64_t(seed) << 40) ^ index) >> 56);
+	}
+
+	inline unsigned char Lerp(unsigned char a, unsigned char b, float t)
+	{
+		return (unsigned char)(float(a) + (float(b) - float(a)) * t + 0.5f);
+	}
+
+	// Maps x to 0 to size-1, going back and forth, so tiles of a photo join up without seams
+	inline int Mirror(int x, int size)
+	{
+		const int period = size * 2;
+		x %= period;
+		return (x < size) ? x : period - 1 - x;
+	}
+}
+
+// Makes a width * height RGB image into pixels. TiledPhoto needs photo, and makes a gradient without one.
+inline void MakeSyntheticImage(std::vector<unsigned char>& pixels, int width, int height, SyntheticImage kind, uint32_t seed, const SyntheticPhoto& photo = SyntheticPhoto())
+{
+	using namespace Synthetic;
+
+	pixels.resize(size_t(width) * size_t(height) * 3);
+	if (kind == SyntheticImage::TiledPhoto && !photo.pixels)
+		kind = SyntheticImage::Gradient;
+
+	// The random colors of the gradient corners and the palette
+	unsigned char colors[c_paletteSize][3];
+	for (int colorIndex = 0; colorIndex < c_paletteSize; ++colorIndex)
+	{
+		for (int channel = 0; channel < 3; ++channel)
+			colors[colorIndex][channel] = RandomByte(seed, uint64_t(1) << 39 | uint64_t(colorIndex * 3 + channel));
+	}
+
+	// Where the tiled photo starts, so different seeds show different parts of it
+	const int photoOffsetX = photo.width > 0 ? int(Hash(seed) % uint64_t(photo.width)) : 0;
+	const int photoOffsetY = photo.height > 0 ? int(Hash(seed + 1) % uint64_t(photo.height)) : 0;
+
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; ++y)
+	{
+		const float v = (height > 1) ? float(y) / float(height - 1) : 0.0f;
+		for (int x = 0; x < width; ++x)
+		{
+			const float u = (width > 1) ? float(x) / float(width - 1) : 0.0f;
+			const size_t pixelIndex = size_t(y) * width + x;
+			unsigned char* pixel = &pixels[pixelIndex * 3];
+
+			switch (kind)
+			{
+				case SyntheticImage::Gradient:
+				{
+					for (int channel = 0; channel < 3; ++channel)
+					{
+						const unsigned char top = Lerp(colors[0][channel], colors[1][channel], u);
+						const unsigned char bottom = Lerp(colors[2][channel], colors[3][channel], u);
+						pixel[channel] = Lerp(top, bottom, v);
+					}
+					break;
+				}
+				case SyntheticImage::Noise:
+				{
+					for (int channel = 0; channel < 3; ++channel)
+						pixel[channel] = RandomByte(seed, pixelIndex * 3 + channel);
+					break;
+				}
+				case SyntheticImage::Posterized:
+				{
+					// Overlapping waves, which make blobs the same size whatever the image size is
+					const float scale = 6.28318f * float(3 + seed % 5);
+					const float wave = sinf(u * scale + float(seed)) + sinf(v * scale * 0.7f) + sinf((u + v) * scale * 0.5f);
+					const int colorIndex = std::min(int((wave + 3.0f) / 6.0f * c_paletteSize), c_paletteSize - 1);
+					for (int channel = 0; channel < 3; ++channel)
+						pixel[channel] = colors[colorIndex][channel];
+					break;
+				}
+				case SyntheticImage::TiledPhoto:
+				{
+					const int photoX = Mirror(x + photoOffsetX, photo.width);
+					const int photoY = Mirror(y + photoOffsetY, photo.height);
+					const unsigned char* photoPixel = &photo.pixels[(size_t(photoY) * photo.width + photoX) * 3];
+					for (int channel = 0; channel < 3; ++channel)
+						pixel[channel] = photoPixel[channel];
+					break;
+				}
+				case SyntheticImage::Count:
+					break;
+			}
+		}
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+// A timeline of what each thread is doing, written as Chrome trace JSON, which chrome://tracing and Perfetto can show.
+// Each thread records events into its own ring buffer, so recording an event doesn't lock. If a thread records more
+// events than fit, the oldest are overwritten.
+// Event names are not copied, so they need to be string literals, or otherwise live until the trace is written.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Trace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static const size_t c_eventsPerThread = 1 << 16;
+
+	struct Event
+	{
+		const char* name;
+		Clock::time_point begin;
+		Clock::time_point end;
+	};
+
+	struct ThreadBuffer
+	{
+		std::vector<Event> events;
+		uint64_t numEvents = 0;     // how many events were ever recorded. The newest is at (numEvents - 1) % events.size().
+		int threadIndex = 0;
+	};
+
+	// Every thread's buffer, and when tracing started. Buffers are only added, so they stay valid until the program exits.
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+		Clock::time_point start = Clock::now();
+	};
+
+	inline Registry& GetRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	// The calling thread's buffer. The registry is only locked the first time a thread records an event.
+	inline ThreadBuffer& GetThreadBuffer()
+	{
+		thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.buffers.emplace_back(new ThreadBuffer());
+			buffer = registry.buffers.back().get();
+			buffer->events.resize(c_eventsPerThread);
+			buffer->threadIndex = int(registry.buffers.size()) - 1;
+		}
+		return *buffer;
+	}
+}
+
+// Records that the calling thread spent from begin to end doing name
+inline void TraceEvent(const char* name, Trace::Clock::time_point begin, Trace::Clock::time_point end)
+{
+	Trace::ThreadBuffer& buffer = Trace::GetThreadBuffer();
+	buffer.events[buffer.numEvents % buffer.events.size()] = { name, begin, end };
+	buffer.numEvents++;
+}
+
+// Records an event from when it is made to when it goes out of scope.
+// The thread's buffer is found first, so the time it takes to make isn't part of the first event.
+struct TraceScope
+{
+	TraceScope(const char* name)
+		: m_name(name)
+	{
+		Trace::GetThreadBuffer();
+		m_begin = Trace::Clock::now();
+	}
+
+	~TraceScope()
+	{
+		TraceEvent(m_name, m_begin, Trace::Clock::now());
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	const char* m_name;
+	Trace::Clock::time_point m_begin;
+};
+
+// Writes the recorded events as Chrome trace JSON. Only call it while no other thread is recording events.
+inline bool WriteTrace(const char* fileName)
+{
+	using namespace Trace;
+
+	FILE* file = nullptr;
+	fopen_s(&file, fileName, "wb");
+	if (!file)
+		return false;
+
+	Registry& registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (const std::unique_ptr<ThreadBuffer>& buffer : registry.buffers)
+	{
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"Thread %i\"}}", first ? "" : ",\n", buffer->threadIndex, buffer->threadIndex);
+		first = false;
+
+		// Complete events, with a begin time and a duration, in microseconds since tracing started
+		const uint64_t numKept = std::min<uint64_t>(buffer->numEvents, buffer->events.size());
+		for (uint64_t eventIndex = buffer->numEvents - numKept; eventIndex < buffer->numEvents; ++eventIndex)
+		{
+			const Event& event = buffer->events[eventIndex % buffer->events.size()];
+			const double begin = std::chrono::duration<double, std::micro>(event.begin - registry.start).count();
+			const double duration = std::chrono::duration<double, std::micro>(event.end - event.begin).count();
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%0.3f,\"dur\":%0.3f}", event.name, buffer->threadIndex, begin, duration);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
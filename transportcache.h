@@ -0,0 +1,261 @@
+#pragma once
+
+// An on disk cache of optimal transport results, so that a repeat run can skip the solve.
+// Files are named by a 128 bit hash of everything that goes into the solve.
+// A file is a 64 byte header followed by the raw float pixels, so the pixels are 64 byte aligned when the file
+// is memory mapped, and can be used in place without copying.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// A read only memory mapping of a whole file
+struct MappedFile
+{
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	MappedFile(MappedFile&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	MappedFile& operator=(MappedFile&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Close();
+			data = other.data;
+			size = other.size;
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const char* fileName)
+	{
+		Close();
+
+		#ifdef _WIN32
+		HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize;
+		HANDLE mapping = nullptr;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping)
+			return false;
+
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (!data)
+			return false;
+		size = size_t(fileSize.QuadPart);
+		#else
+		int file = open(fileName, O_RDONLY);
+		if (file < 0)
+			return false;
+
+		struct stat fileStat;
+		void* mapping = MAP_FAILED;
+		if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+			mapping = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		close(file);
+		if (mapping == MAP_FAILED)
+			return false;
+
+		data = (const unsigned char*)mapping;
+		size = size_t(fileStat.st_size);
+		#endif
+		return true;
+	}
+
+	void Close()
+	{
+		if (data)
+		{
+			#ifdef _WIN32
+			UnmapViewOfFile(data);
+			#else
+			munmap((void*)data, size);
+			#endif
+		}
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+};
+
+// The pixels of an optimal transport result. They are either owned, or in a memory mapped cache file.
+struct TransportResult
+{
+	const float* data() const
+	{
+		return mapped.data ? (const float*)&mapped.data[mappedOffset] : pixels.data();
+	}
+
+	size_t size() const
+	{
+		return mapped.data ? mappedCount : pixels.size();
+	}
+
+	float operator[](size_t index) const
+	{
+		return data()[index];
+	}
+
+	std::vector<float> pixels;
+
+	MappedFile mapped;
+	size_t mappedOffset = 0;
+	size_t mappedCount = 0;
+};
+
+namespace TransportCache
+{
+	static const char c_magic[8] = { 'S', 'O', 'T', 'C', 'A', 'C', 'H', 'E' };
+	static const uint32_t c_headerSize = 64;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t headerSize;
+		uint32_t width;
+		uint32_t height;
+		uint32_t channels;
+		uint64_t key[2];
+		unsigned char padding[24];
+	};
+	static_assert(sizeof(Header) == c_headerSize, "The header needs to keep the pixels 64 byte aligned");
+
+	inline uint64_t Mix(uint64_t value)
+	{
+		value ^= value >> 33;
+		value *= 0xff51afd7ed558ccdull;
+		value ^= value >> 33;
+		value *= 0xc4ceb9fe1a85ec53ull;
+		value ^= value >> 33;
+		return value;
+	}
+}
+
+// Hashes data into the 128 bit key, 8 bytes at a time. Two different multipliers make the two halves independent.
+inline void HashBytes(uint64_t key[2], const void* data, size_t size)
+{
+	using namespace TransportCache;
+
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint64_t a = key[0] ^ Mix(size);
+	uint64_t b = key[1] ^ Mix(size + 1);
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t value;
+		memcpy(&value, &bytes[i], 8);
+		a = (a ^ value) * 0x9E3779B97F4A7C15ull;
+		a ^= a >> 29;
+		b = (b + value) * 0xD6E8FEB86659FD93ull;
+		b ^= b >> 32;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, &bytes[i], size - i);
+	key[0] = Mix(a ^ tail);
+	key[1] = Mix(b + tail);
+}
+
+// Makes the cache file name for a key, in the given directory
+inline void TransportCacheFileName(char* fileName, size_t fileNameSize, const char* directory, const uint64_t key[2])
+{
+	snprintf(fileName, fileNameSize, "%s/%016llx%016llx.sot", directory, (unsigned long long)key[0], (unsigned long long)key[1]);
+}
+
+// Memory maps a cache file into result, if it exists and matches the key and size
+inline bool LoadCachedTransport(const char* fileName, const uint64_t key[2], int width, int height, TransportResult& result)
+{
+	using namespace TransportCache;
+
+	MappedFile mapped;
+	if (!mapped.Open(fileName) || mapped.size < c_headerSize)
+		return false;
+
+	Header header;
+	memcpy(&header, mapped.data, sizeof(header));
+	const size_t count = size_t(width) * size_t(height) * 3;
+	if (memcmp(header.magic, c_magic, sizeof(c_magic)) != 0 || header.headerSize != c_headerSize ||
+		header.width != uint32_t(width) || header.height != uint32_t(height) || header.channels != 3 ||
+		header.key[0] != key[0] || header.key[1] != key[1] || mapped.size != c_headerSize + count * sizeof(float))
+	{
+		return false;
+	}
+
+	result.pixels.clear();
+	result.pixels.shrink_to_fit();
+	result.mapped = std::move(mapped);
+	result.mappedOffset = c_headerSize;
+	result.mappedCount = count;
+	return true;
+}
+
+// Writes a cache file. It's written under a temporary name first, so a partial file is never seen under the real name.
+inline bool SaveCachedTransport(const char* fileName, const uint64_t key[2], int width, int height, const float* pixels)
+{
+	using namespace TransportCache;
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, c_magic, sizeof(c_magic));
+	header.headerSize = c_headerSize;
+	header.width = uint32_t(width);
+	header.height = uint32_t(height);
+	header.channels = 3;
+	header.key[0] = key[0];
+	header.key[1] = key[1];
+
+	char tempFileName[1024];
+	if (snprintf(tempFileName, sizeof(tempFileName), "%s.tmp", fileName) >= int(sizeof(tempFileName)))
+		return false;
+
+	FILE* file = nullptr;
+	fopen_s(&file, tempFileName, "wb");
+	if (!file)
+		return false;
+
+	const size_t count = size_t(width) * size_t(height) * 3;
+	bool ret = fwrite(&header, sizeof(header), 1, file) == 1;
+	ret &= fwrite(pixels, sizeof(float), count, file) == count;
+	ret &= fclose(file) == 0;
+
+	if (ret)
+	{
+		remove(fileName);
+		ret = rename(tempFileName, fileName) == 0;
+	}
+	if (!ret)
+		remove(tempFileName);
+	return ret;
+}